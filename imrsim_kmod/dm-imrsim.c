@@ -3,13 +3,23 @@
 #include <linux/blkdev.h>
 #include <linux/bio.h>
 #include <linux/device-mapper.h>
+#include <linux/dm-bufio.h>
 #include <linux/delay.h>
 #include <linux/bitops.h>
 #include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #include <linux/crc32.h>
 #include <linux/gfp.h>
+#include <linux/mempool.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 #include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/random.h>
 #include <linux/version.h>
 #include <asm/ptrace.h>
 #include "imrsim_types.h"
@@ -17,6 +27,18 @@
 #include "imrsim_kapi.h"
 #include "imrsim_zerror.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#error "imrsim needs the device-mapper bio API of Linux 6.0 or later"
+#endif
+
+/* The __u64 words of the top-track bitmaps are used as unsigned long bitmaps. */
+#if defined(__BIG_ENDIAN) && BITS_PER_LONG == 32
+#error "imrsim top-track bitmaps need a 64-bit or little-endian kernel"
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "imrsim_trace.h"
+
 /*
  The kernel module in the Device Mapper framework is mainly responsible for 
  building the target driver to build the disk structure and function.
@@ -28,7 +50,7 @@
 #define IMR_PAGE_SIZE_SHIFT_DEFAULT      3       /* number of sectors/page, 8    */  //一个页由多少扇区组成
 #define IMR_SECTOR_SIZE_SHIFT_DEFAULT    9       /* number of bytes/sector, 512  */  //一个扇区包括512字节
 #define IMR_TRANSFER_PENALTY             60      /* usec */   //延迟
-#define IMR_TRANSFER_PENALTY_MAX         1000    /* usec */
+#define IMR_TRANSFER_PENALTY_MAX         65535   /* usec, limit of the __u16 config fields */
 #define IMR_ROTATE_PENALTY               11000   /* usec ,  5400rpm->  rotate time: 11ms*/
 
 
@@ -40,44 +62,25 @@
  * A group of top-bottom has 4MB, that is, 1024 blocks, and there are 64 groups of top-bottom in a zone.
  */
 
-#define IMR_MAX_CAPACITY                 21474836480
-
-static __u64   IMR_CAPACITY;            /* disk capacity (in sectors) */  //磁盘容量（sector为单位）
-static __u32   IMR_NUMZONES;            /* number of zones */   //zone的数量
-static __u32   IMR_NUMZONES_DEFAULT;                            //zone的数量
-static __u32   IMR_ZONE_SIZE_SHIFT;                             //一个zone有多少块
-static __u32   IMR_BLOCK_SIZE_SHIFT;                            //一个块由多少扇区组成
-
 static __u32 IMR_TOP_TRACK_SIZE = 456;      /* number of blocks/topTrack  456 */  //一个顶部磁道中有456个块
 static __u32 IMR_BOTTOM_TRACK_SIZE = 568;   /* number of blocks/bottomTrack  568 */ //一个底部磁道有568个块
 
-__u32 VERSION = IMRSIM_VERSION(1,1,0);      /* The version number of IMRSIM：VERSION(x,y,z)=>((x<<16)|(y<<8)|z) */
+__u32 VERSION = IMRSIM_VERSION(1,8,0);      /* The version number of IMRSIM：VERSION(x,y,z)=>((x<<16)|(y<<8)|z) */
 
-struct imrsim_c{             /* Mapped devices in the Device Mapper framework, also known as logical devices. */
-    struct dm_dev *dev;      /* block device */
-    sector_t       start;    /* starting address */
+/* How a RMW makes its writes durable, set by the rmw_fua/rmw_flush table feature */
+enum imrsim_rmw_durability{
+    IMR_RMW_DURABLE_FUA   = 0x00,   /* every write of the RMW is FUA */
+    IMR_RMW_DURABLE_FLUSH = 0x01    /* plain writes and one flush at the end of the RMW */
 };
 
-/* Mutex resource locks */
-/*互斥资源锁*/
-struct mutex                     imrsim_zone_lock;
-struct mutex                     imrsim_ioctl_lock;
-
-/* IMRSIM Statistics */
-/*IMRSim统计数据*/
-static struct imrsim_state       *zone_state = NULL;
-/* Array of zone status information */
-/*zone状态信息数组*/
-static struct imrsim_zone_status *zone_status = NULL;
-
-/* error log */
-static __u32 imrsim_dbg_rerr;
-static __u32 imrsim_dbg_werr;
-static __u32 imrsim_dbg_log_enabled = 0;
-static unsigned long imrsim_dev_idle_checkpoint = 0;
+/* How the mapping tables are kept, set by the map_block/map_extent table feature */
+enum imrsim_map_mode{
+    IMR_MAP_BLOCK  = 0x00,   /* one entry per block, struct imrsim_zone_map */
+    IMR_MAP_EXTENT = 0x01    /* sorted runs of blocks, struct imrsim_zone_extents */
+};
 
-/* Multi-device support, currently not supported */
-int imrsim_single = 0;
+/* Number of mutexes the zones are sharded over, zone i uses shard i % IMR_ZONE_LOCK_SHARDS */
+#define IMR_ZONE_LOCK_SHARDS             128
 
 /* Constants representing configuration changes */
 /*表示配置更改的常量*/
@@ -88,74 +91,448 @@ enum imrsim_conf_change{
     IMR_STATUS_CHANGE = 0x04
 };
 
-/* persistent storage */
-#define IMR_PSTORE_PG_EDG 92
-#define IMR_PSTORE_PG_OFF 40
-#define IMR_PSTORE_CHECK  1000
-#define IMR_PSTORE_QDEPTH 128
-#define IMR_PSTORE_PG_GAP 2
+/* persistent storage, the defaults of the max_stale/min_batch table features */
+#define IMR_PSTORE_STALE  1000   /* msec, a mapping update waits at most so long for the disk */
+#define IMR_PSTORE_BATCH  IMR_JOURNAL_RECS   /* journal records which wake the thread earlier */
 
 /* persistent storage task structure */
-static struct imrsim_pstore_task    //元数据持久化任务，在主线程之外的一个线程中执行
+struct imrsim_pstore_task    //元数据持久化任务，在主线程之外的一个线程中执行
 {
     struct task_struct  *pstore_thread;   // 进程描述符（process descriptor) 结构  持久化线程
-    __u32                sts_zone_idx;
-    __u32                stu_zone_idx[IMR_PSTORE_QDEPTH];
-    __u8                 stu_zone_idx_cnt;
-    __u8                 stu_zone_idx_gap;
+    wait_queue_head_t    wait;             /* the thread sleeps on it until a change or a deadline */
+    unsigned int         max_stale;        /* msec */
+    unsigned int         min_batch;        /* journal records */
+    spinlock_t           lock;             /* protects the flag against concurrent zones */
     sector_t             pstore_lba;       //持久化开始的地址
+    bool                 loaded;           /* the metadata was read, by the first resume */
     unsigned char        flag;              /* three bit for imrsim_conf_change */  //持计划类型标识
                                             //利用该数据的最低3位分别表示3种磁盘配置改变的事件，
                                             //0x01表示IMR_CONFIG_CHANGE，0x02表示IMR_STATS_CHANGE，
                                             //0x04表示IMR_STATUS_CHANGE，判断时只需要用flag按位与不同类型的宏就能判断那种元数据发生了改变。
-}imrsim_ptask;
+};
+
+/*
+ * Journal of the mapping updates, in the persistence area after the slots of the mapping
+ * tables. The state on the disk is the one of the last checkpoint, the journal holds the
+ * PBAs allocated since then and is replayed on top of it at load.
+ */
+#define IMR_JOURNAL_MAGIC                0x4A524E4C
+#define IMR_JOURNAL_PAGES                256     /* 1MB */
+#define IMR_JOURNAL_CHECKPOINT           60000   /* msec, at most between two checkpoints */
 
-/* RMW scheme structure */
+/* A block of a zone mapped to a newly allocated PBA, map_size is z_map_size after it */
+struct imrsim_journal_rec
+{
+    __u32               zone_idx;
+    __u16               block;
+    __u16               pba;
+    __u32               map_size;
+};
+
+/* A page of the journal, its records belong to the checkpoint whose seq it carries */
+struct imrsim_journal_page
+{
+    __u32               magic;
+    __u32               crc32;         /* of the page after this field */
+    __u32               seq;
+    __u32               index;         /* in the journal, the pages are filled in order */
+    __u32               nr;
+    __u32               reserved;
+    struct imrsim_journal_rec rec[];
+};
+
+#define IMR_JOURNAL_RECS ((PAGE_SIZE - sizeof(struct imrsim_journal_page)) / sizeof(struct imrsim_journal_rec))
+
+/* The journal since the last checkpoint, an image of its area appended under the lock */
+struct imrsim_journal
+{
+    spinlock_t          lock;
+    unsigned char       *pages;        /* IMR_JOURNAL_PAGES pages and the copy of the last one */
+    __u32               head;          /* page the next record goes to */
+    __u32               synced;        /* first page with records not written yet */
+    __u32               pending;       /* records since the last write of the journal */
+    __u32               mark;          /* records a checkpoint being written holds */
+    __u8                dirty;
+    __u8                overflow;      /* records were dropped, only a checkpoint saves them */
+    __u8                mark_overflow; /* overflow when the checkpoint was taken */
+    unsigned long       since;         /* jiffies of the first record not written yet */
+    unsigned long       checkpoint;    /* jiffies of the last checkpoint */
+};
+
+/* RMW batching: bottom-track writes of a track group are gathered for a short window */
+#define IMR_RMW_BATCH_WINDOW             1       /* msec */
+#define IMR_RMW_BATCH_MAX                64      /* bios, the batch starts at once when it is reached */
+
+/* Stages of a RMW batch, each one is started by the completion of the previous one */
+enum imrsim_rmw_stage{
+    IMR_RMW_COLLECT   = 0x00,    /* open to the writes of its track group */
+    IMR_RMW_BACKUP    = 0x01,    /* read the neighbor top-track blocks */
+    IMR_RMW_WRITE     = 0x02,    /* write the bottom-track bios */
+    IMR_RMW_WRITEBACK = 0x03,    /* write the neighbor blocks back */
+    IMR_RMW_FLUSH     = 0x04,    /* flush the device, IMR_RMW_DURABLE_FLUSH only */
+    IMR_RMW_DONE      = 0x05
+};
+
+/* RMW scheme structure, kept in the per-bio data of the bottom-track write */
 /*RMW方案结构*/
-static struct imrsim_RMW_task
+struct imrsim_rmw_task
+{
+    struct list_head    list;          /* in the bios of the batch */
+    struct bio          *bio;
+    struct imrsim_rmw_batch *batch;
+    __u32               trackno;       /* track group of the bottom-track blocks */
+    __u32               nr_top;        /* used top-track blocks they overlap */
+    unsigned long       top[2][BITS_TO_LONGS(TOP_TRACK_SIZE)];   /* on tracks trackno and trackno+1 */
+};
+
+/* The RMW of a track group, for all the bottom-track writes gathered in it */
+struct imrsim_rmw_batch
 {
-    struct task_struct  *task;
+    struct delayed_work dwork;
+    struct list_head    list;          /* in batcher.batches */
+    struct list_head    bios;
+    struct dm_target    *ti;
+    __u32               zone_idx;
+    __u32               trackno;
+    __u32               nr_bios;
+    unsigned long       top[2][BITS_TO_LONGS(TOP_TRACK_SIZE)];   /* union of the bios' top-track blocks */
+    struct page         *pages[2][TOP_TRACK_SIZE];
+    struct bio_list     waiters;       /* top-track writes of its blocks held until it is done */
+    __u32               nr_writes;     /* top-track writes in flight its backup waits for */
+    __u8                stage;
+    __u8                deferred;      /* waits for the running batch of its track group */
+    atomic_t            pending;       /* bios in flight in the current stage */
+    blk_status_t        error;
+};
+
+/* Injected latency of an out-of-policy bio, kept in its per-bio data */
+struct imrsim_delay_task
+{
+    struct hrtimer      timer;
+    struct imrsim_c     *c;
     struct bio          *bio;
-    sector_t            lba[2];
-    __u8                lba_num;
-}imrsim_rmw_task;
+    blk_status_t        error;
+    __u8                end;           /* complete the bio instead of resubmitting it */
+};
+
+/* Clones a pass of a split read holds at most, the rest of the read comes back through map */
+#define IMR_READ_MAX_RUNS                32
+
+/* A read split over several PBA runs, completed when all its clones are */
+struct imrsim_read_task
+{
+    struct bio          *bio;          /* NULL unless the read is split */
+    atomic_t            pending;
+    blk_status_t        error;
+    unsigned int        penalty;
+};
+
+/* The top-track run of a write, in batcher.writes while it is in flight */
+struct imrsim_top_write
+{
+    struct list_head    list;
+    __u32               zone_idx;
+    __u32               trackno;
+    __u32               first;
+    __u32               nr;            /* 0 if the write has no top-track block */
+};
+
+/* per-bio data of the target */
+struct imrsim_per_bio
+{
+    struct imrsim_rmw_task   rmw;
+    struct imrsim_top_write  top;
+    struct imrsim_read_task  read;
+    struct imrsim_delay_task delay;
+};
+
+/* Pages of the RMW backups and the meta-data buffer, the reserve covers the largest batch */
+#define IMR_PAGE_POOL_SIZE               (2 * TOP_TRACK_SIZE + 1)
+#define IMR_RMW_BATCH_POOL_SIZE          16
+
+/* Batches of the track groups, open or running, and the top-track writes in flight */
+struct imrsim_rmw_batcher
+{
+    spinlock_t          lock;          /* taken in the completion of the writes too */
+    struct list_head    batches;
+    struct list_head    writes;
+};
+
+/* Delayed bios whose timer fired, waiting to be resubmitted */
+struct imrsim_delay_control
+{
+    spinlock_t          lock;
+    struct bio_list     bios;
+    struct work_struct  work;
+};
 
-/* read/write completion structure */
-static struct imrsim_completion_control
+/* read/write completion structure (meta-data I/O) */
+struct imrsim_completion_control
 {
     struct completion   read_event;
     struct completion   write_event;
-    struct completion   rmw_event;
-}imrsim_completion;
+};
+
+/* Meta-data writes submitted together, waited for together and made durable by one flush */
+struct imrsim_md_io
+{
+    atomic_t            pending;
+    blk_status_t        error;
+    struct completion   done;
+};
+
+/*
+ * Layout of the mapping table of a zone in its slot, the bitmaps are cleared on
+ * its first write. The in-zone block offsets fit in 16 bits, mapped[] tells the
+ * entries of pba[] in use. The reverse map gives the block owning a PBA, used[]
+ * tells the PBAs owned.
+ */
+struct imrsim_zone_map
+{
+    unsigned long       mapped[BITS_TO_LONGS(TOTAL_ITEMS)];
+    __u16               pba[TOTAL_ITEMS];
+    unsigned long       used[BITS_TO_LONGS(TOTAL_ITEMS)];
+    __u16               lba[TOTAL_ITEMS];
+};
+
+/* A run of len blocks from start mapped to the blocks from target */
+struct imrsim_extent
+{
+    __u16               start;
+    __u16               target;
+    __u32               len;
+};
+
+/* Extents sorted by start, updated in place and replaced by a larger copy when full */
+struct imrsim_extent_array
+{
+    struct rcu_head     rcu;
+    __u32               nr;
+    __u32               max;
+    struct imrsim_extent ext[];
+};
+
+#define IMR_EXTENTS_MIN                  16
+
+/*
+ * Mapping table of a zone in extent mode, allocated on its first write. The reads
+ * search it without the zone lock, a search costs O(log extents). The updates shift
+ * the extents in place: the seqcount of the zone makes the reads retry over them,
+ * RCU only keeps an array replaced by a larger one alive until they left it.
+ */
+struct imrsim_zone_extents
+{
+    struct imrsim_extent_array __rcu *fwd;    /* block offsets to PBAs */
+    struct imrsim_extent_array __rcu *rev;    /* PBAs to block offsets */
+};
+
+/* A zone's mapping table takes a slot of whole pages after the state in the persistence area */
+#define IMR_MAP_SLOT_SECTORS             (round_up(sizeof(struct imrsim_zone_map), PAGE_SIZE) >> IMR_SECTOR_SIZE_SHIFT_DEFAULT)
+#define IMR_NO_PBA                       (~0u)   /* the mapping table of the zone could not be updated */
+
+/* A simulated IMR device, all its state lives here so that several targets run side by side */
+struct imrsim_c{             /* Mapped devices in the Device Mapper framework, also known as logical devices. */
+    struct dm_dev *dev;      /* block device */
+    sector_t       start;    /* starting address */
+    __u8           rmw_durability;
+    __u8           map_mode;
+
+    __u64          capacity;            /* disk capacity (in sectors) */  //磁盘容量（sector为单位）
+    __u32          nr_zones;            /* number of zones */   //zone的数量
+    __u32          nr_zones_default;
+    __u32          zone_size_shift;     /* number of blocks/zone */   //一个zone有多少块
+    __u32          block_size_shift;    /* number of sectors/block */ //一个块由多少扇区组成
+
+    /* Mutex resource locks */
+    /*互斥资源锁*/
+    /* Taken shared by the I/O path and exclusively by operations touching all zones (config, resize, flush). */
+    struct rw_semaphore  state_lock;
+    /* Protect zone_status[], the mapping table and zone_stats[] of a single zone. */
+    struct mutex         zone_locks[IMR_ZONE_LOCK_SHARDS];
+    /*
+     * Bumped around the updates of the mapping table of the zones of a shard, the
+     * reads walk the table without the zone lock and retry when it changed.
+     */
+    seqcount_mutex_t     zone_seqs[IMR_ZONE_LOCK_SHARDS];
+    /* Protect the device-wide counters in zone_state->stats. */
+    spinlock_t           stats_lock;
+    struct mutex         ioctl_lock;
+
+    /* IMRSIM Statistics */
+    /*IMRSim统计数据*/
+    struct imrsim_state       *zone_state;
+    /* Pages of zone_state changed since the last checkpoint */
+    unsigned long             *state_dirty;
+    /* crc32 of each page of zone_state as last written, the table follows the state on the disk */
+    __u32                     *state_crcs;
+    /* Pages the last checkpoint wrote to its copy of the state, the other copy lacks them */
+    unsigned long             *prev_dirty;
+    /* The copy of the state the last checkpoint committed, the next one writes the other */
+    __u32                     state_copy;
+    /* Copy of the pages a running checkpoint writes, taken under the exclusive state lock. They
+       are packed in the order of shadow_dirty and only allocated while the checkpoint runs. */
+    struct imrsim_state       *shadow;
+    unsigned long             *shadow_dirty;
+    /* Array of zone status information, the small fields the I/O path and the queries check */
+    /*zone状态信息数组*/
+    struct imrsim_zone_status *zone_status;
+    /* Occupancy of the top tracks, TOP_TRACK_NUM_TOTAL per zone, kept apart from zone_status[] */
+    struct imrsim_zone_track  *zone_tracks;
+    /*
+     * Block mode: the mapping tables stay in their slots and are cached page by page,
+     * the slot of a zone is valid once z_map_size is not 0.
+     */
+    struct dm_bufio_client      *bufio;
+    /* Extent mode: the mapping tables of the zones, NULL until the zone is written */
+    struct imrsim_zone_extents **zone_extents;
+    /* Extent mode: the zones whose table changed since the last checkpoint */
+    unsigned long               *maps_dirty;
+    /* Extent mode: copies of the changed tables a running checkpoint writes */
+    struct imrsim_zone_extents **maps_shadow;
+    /* Extent mode: the zones whose table is still in its slot, read on their first access */
+    unsigned long               *maps_lazy;
+    __u32                        nr_maps;
+    /* Extent mode: a zone's table laid out as in block mode, the format of its slot */
+    struct imrsim_zone_map      *map_buf;
+
+    /* error log */
+    __u32          dbg_rerr;
+    __u32          dbg_werr;
+    __u32          dbg_log_enabled;
+    unsigned long  idle_checkpoint;
+
+    struct imrsim_pstore_task  ptask;
+    struct imrsim_journal      journal;
+
+    /* Clones of the split reads */
+    struct bio_set bio_set;
+    /* Clones of the RMW bottom-track writes, a RMW never waits for the reads to give theirs back */
+    struct bio_set rmw_bio_set;
+    /* Bios of the RMW and meta-data I/O, apart from the clones so that one never waits for the other */
+    struct bio_set io_bio_set;
+    mempool_t      *page_pool;
+    mempool_t      *batch_pool;
+    /* Only one batch at a time takes pages from the pool, so that the reserve is enough for it */
+    struct mutex   rmw_page_lock;
+
+    /* RMW engine, shared by all the zones, it also resubmits the delayed bios */
+    struct workqueue_struct          *rmw_wq;
+    struct imrsim_rmw_batcher        batcher;
+    struct imrsim_delay_control      delayed;
+    struct imrsim_completion_control completion;
+    /* Bios of the zones whose mapping table is still in its slot, mapped again once it is read */
+    struct imrsim_delay_control      faults;
+    struct dm_target                 *ti;
+};
 
 /* To get the size of the imrsim_stats structure. */
-static __u32 imrsim_stats_size(void)
+static __u32 imrsim_stats_size(struct imrsim_c *c)
 {
     return (sizeof(struct imrsim_dev_stats) + sizeof(__u32) + sizeof(__u64)*2 +
-            sizeof(struct imrsim_zone_stats) * IMR_NUMZONES);
+            sizeof(struct imrsim_zone_stats) * c->nr_zones);
+}
+
+/* Bytes of the state taken by each zone: its stats, its status and the occupancy of its top tracks */
+#define IMR_STATE_ZONE_SIZE  (sizeof(struct imrsim_zone_stats) + sizeof(struct imrsim_zone_status) + \
+                              sizeof(struct imrsim_zone_track) * TOP_TRACK_NUM_TOTAL)
+
+/* To get the size of the imrsim_state structure of nr_zones zones, it must fit header.length. */
+static __u64 imrsim_state_size(__u64 nr_zones)
+{
+    return offsetof(struct imrsim_state, stats.zone_stats) + nr_zones * IMR_STATE_ZONE_SIZE + sizeof(__u32);
+}
+
+/*
+ * To find the arrays of a state of nr_zones zones: zone_stats[], then zone_status[]
+ * and zone_tracks[], so that the scans of the zones walk contiguous memory.
+ */
+static void imrsim_state_layout(struct imrsim_c *c, __u32 nr_zones)
+{
+    c->zone_status = (struct imrsim_zone_status *)&c->zone_state->stats.zone_stats[nr_zones];
+    c->zone_tracks = (struct imrsim_zone_track *)&c->zone_status[nr_zones];
+}
+
+#define IMR_CRCS_PER_PAGE                (PAGE_SIZE / sizeof(__u32))
+/* Checkpoints alternate between the copies of the state, the newest valid one is loaded */
+#define IMR_STATE_COPIES                 2
+
+/* Pages of the table of the page crcs of a state of len bytes. */
+static __u32 imrsim_state_crc_pages(__u32 len)
+{
+    return DIV_ROUND_UP(DIV_ROUND_UP(len, PAGE_SIZE) * sizeof(__u32), PAGE_SIZE);
+}
+
+/* To get the crc32 of page idx of a state held at page, the one of page 0 leaves the header out. */
+static __u32 imrsim_state_page_crc(const void *page, __u32 idx)
+{
+    const unsigned char *p = page;
+    size_t skip = idx ? 0 : sizeof(struct imrsim_state_header);
+
+    return crc32(0, p + skip, PAGE_SIZE - skip);
+}
+
+/*
+ * To mark the pages of the state holding [ptr, ptr+len) for the next checkpoint. Page 0,
+ * with the header, the config and the device counters, is written by every checkpoint.
+ */
+static void imrsim_state_dirty(struct imrsim_c *c, const void *ptr, size_t len)
+{
+    size_t off = (const unsigned char *)ptr - (const unsigned char *)c->zone_state;
+    size_t pg;
+
+    if(!len){
+        return;
+    }
+    for(pg = off / PAGE_SIZE; pg <= (off + len - 1) / PAGE_SIZE; pg++){
+        if(!test_bit(pg, c->state_dirty)){   // most of the writes hit pages already dirty
+            set_bit(pg, c->state_dirty);
+        }
+    }
 }
 
-/* To get the size of the imrsim_state structure. */
-static __u32 imrsim_state_size(void)
+/* To replace the state by a zeroed one of size bytes with all its pages dirty, the old one stays on failure. */
+static int imrsim_state_realloc(struct imrsim_c *c, __u64 size)
 {
-    return (sizeof(struct imrsim_state_header) + 
-            sizeof(struct imrsim_config) + 
-            sizeof(struct imrsim_dev_stats) + sizeof(__u32) +
-            IMR_NUMZONES * sizeof(struct imrsim_zone_stats) + 
-            IMR_NUMZONES * sizeof(struct imrsim_zone_status) +
-            sizeof(__u32));
+    __u32 nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct imrsim_state *state = vzalloc((size_t)nr_pages * PAGE_SIZE);   // read and written in whole pages
+    unsigned long *dirty = bitmap_alloc(nr_pages, GFP_KERNEL);
+    unsigned long *prev_dirty = bitmap_alloc(nr_pages, GFP_KERNEL);
+    unsigned long *shadow_dirty = bitmap_zalloc(nr_pages, GFP_KERNEL);
+    __u32 *crcs = vzalloc((size_t)imrsim_state_crc_pages(size) * PAGE_SIZE);
+
+    if(!state || !dirty || !prev_dirty || !shadow_dirty || !crcs){
+        vfree(state);
+        bitmap_free(dirty);
+        bitmap_free(prev_dirty);
+        bitmap_free(shadow_dirty);
+        vfree(crcs);
+        return -ENOMEM;
+    }
+    bitmap_fill(dirty, nr_pages);
+    bitmap_fill(prev_dirty, nr_pages);   // both copies on the disk are written whole
+    vfree(c->zone_state);
+    bitmap_free(c->state_dirty);
+    bitmap_free(c->prev_dirty);
+    bitmap_free(c->shadow_dirty);
+    vfree(c->state_crcs);
+    c->zone_state = state;
+    c->state_dirty = dirty;
+    c->prev_dirty = prev_dirty;
+    c->shadow_dirty = shadow_dirty;
+    c->state_crcs = crcs;
+    return 0;
 }
 
 /* To get how many sectors a zone has. */
-static __u32 num_sectors_zone(void)
+static __u32 num_sectors_zone(struct imrsim_c *c)
 {
-    return (1 << IMR_BLOCK_SIZE_SHIFT << IMR_ZONE_SIZE_SHIFT);
+    return (1 << c->block_size_shift << c->zone_size_shift);
 }
 
 /* To get the sector address where the zone starts. */
 /*获取zone的起始地址*/
-static __u64 zone_idx_lba(__u64 idx){
-    return (idx << IMR_BLOCK_SIZE_SHIFT << IMR_ZONE_SIZE_SHIFT);  
+static __u64 zone_idx_lba(struct imrsim_c *c, __u64 idx){
+    return (idx << c->block_size_shift << c->zone_size_shift);  
 }
 
 /* Returns the exponent of a power of 2. */
@@ -168,602 +545,2299 @@ static __u64 index_power_of_2(__u64 num)
     return index;
 }
 
-/* Device idle time initialization. */
-static void imrsim_dev_idle_init(void)
+/* To get the lock of a zone. */
+static struct mutex *imrsim_zone_lock(struct imrsim_c *c, __u32 zone_idx)
 {
-    imrsim_dev_idle_checkpoint = jiffies;
-    zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = 0;
-    zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = jiffies / HZ;
+    return &c->zone_locks[zone_idx % IMR_ZONE_LOCK_SHARDS];
 }
 
-/* Basic information for initializing zone. */
-static void imrsim_init_zone_default(__u64 sizedev)   /* sizedev: in sectors */ //siedev以sector为单位
+/* To get the mapping table seqcount of a zone, written with the lock of the zone held. */
+static seqcount_mutex_t *imrsim_zone_seq(struct imrsim_c *c, __u32 zone_idx)
 {
-    IMR_CAPACITY = sizedev;
-    IMR_ZONE_SIZE_SHIFT = IMR_ZONE_SIZE_SHIFT_DEFAULT;
-    IMR_BLOCK_SIZE_SHIFT = IMR_BLOCK_SIZE_SHIFT_DEFAULT;
-    IMR_NUMZONES = (IMR_CAPACITY >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT);
-    IMR_NUMZONES_DEFAULT = IMR_NUMZONES;
-    printk(KERN_INFO "imrsim_init_zone_state: numzones=%d sizedev=%llu\n",
-        IMR_NUMZONES, sizedev); 
+    return &c->zone_seqs[zone_idx % IMR_ZONE_LOCK_SHARDS];
 }
 
-/* Basic information for initializing the device state (zone_state) */
-/*磁盘统计信息*/
-static void imrsim_init_zone_state_default(__u32 state_size)
+static struct imrsim_extent_array *imrsim_extents_alloc(__u32 max, gfp_t gfp)
 {
-    __u32 i;
-    __u32 j;
-    __u32 *magic;   /* magic number to identify the device (equipment identity) */
+    struct imrsim_extent_array *arr = kvmalloc(struct_size(arr, ext, max), gfp);
 
-    /* head info. */
-    zone_state->header.magic = 0xBEEFBEEF;
-    zone_state->header.length = state_size;
-    zone_state->header.version = VERSION;
-    zone_state->header.crc32 = 0;
+    if(arr){
+        arr->nr = 0;
+        arr->max = max;
+    }
+    return arr;
+}
 
-    /* config info. */
-    zone_state->config.dev_config.out_of_policy_read_flag = 0;
-    zone_state->config.dev_config.out_of_policy_write_flag = 0;
-    zone_state->config.dev_config.r_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
-    zone_state->config.dev_config.w_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
-
-    zone_state->stats.num_zones = IMR_NUMZONES;
-    zone_state->stats.extra_write_total = 0;
-    zone_state->stats.write_total = 0;
-    imrsim_reset_stats();  
-    /* To allocate space for the zone_status array and initialize it. */
-    /*为 zone_status 数组分配空间并初始化它。*/
-    zone_status = (struct imrsim_zone_status *)&zone_state->stats.zone_stats[IMR_NUMZONES];//强制转换成(struct imrsim_zone_status *)类型指针
-    for(i=0; i<IMR_NUMZONES; i++){
-        zone_status[i].z_start = i;
-        zone_status[i].z_length = num_sectors_zone();
-        zone_status[i].z_type = Z_TYPE_CONVENTIONAL;
-        zone_status[i].z_conds = Z_COND_NO_WP;
-        zone_status[i].z_flag = 0;
-        for(j=0;j<TOP_TRACK_NUM_TOTAL;j++){
-            memset(zone_status[i].z_tracks[j].isUsedBlock,0,IMR_TOP_TRACK_SIZE*sizeof(__u8));
-        }
-        zone_status[i].z_map_size = 0;
-        memset(zone_status[i].z_pba_map,-1,TOP_TRACK_NUM_TOTAL*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)*sizeof(int));
+static void imrsim_zone_extents_free(struct imrsim_zone_extents *ze)
+{
+    if(ze){
+        kvfree(rcu_dereference_protected(ze->fwd, true));
+        kvfree(rcu_dereference_protected(ze->rev, true));
+        kfree(ze);
     }
-    printk(KERN_INFO "imrsim: %s zone_status init!\n", __FUNCTION__);
-    magic = (__u32 *)&zone_status[IMR_NUMZONES];
-    *magic = 0xBEEFBEEF;
 }
 
-/* To initial a device. */
-int imrsim_init_zone_state(__u64 sizedev)
+static struct imrsim_zone_extents *imrsim_zone_extents_alloc(__u32 nr_fwd, __u32 nr_rev, gfp_t gfp)
 {
-    __u32 state_size;
+    struct imrsim_zone_extents *ze = kzalloc(sizeof(*ze), gfp);
 
-    if(!sizedev){
-        printk(KERN_ERR "imrsim: zero capacity detected\n");
-        return -EINVAL;
+    if(!ze){
+        return NULL;
     }
-    imrsim_init_zone_default(sizedev);     /* Initialize the basic information of the zone.初始化zone的基本信息 */
-    /* zone_state should not have allocated space, if it already exists, reclaim the space. */
-    if(zone_state){
-        vfree(zone_state);
-    }
-    state_size = imrsim_state_size();  // 获取imrsim_state结构的大小
-    zone_state = vzalloc(state_size);     /* Allocate memory space for zone_state */
-    if(!zone_state){
-        printk(KERN_ERR "imrsim: memory alloc failed for zone state\n");
-        return -ENOMEM;
+    RCU_INIT_POINTER(ze->fwd, imrsim_extents_alloc(max_t(__u32, nr_fwd, IMR_EXTENTS_MIN), gfp));
+    RCU_INIT_POINTER(ze->rev, imrsim_extents_alloc(max_t(__u32, nr_rev, IMR_EXTENTS_MIN), gfp));
+    if(!rcu_access_pointer(ze->fwd) || !rcu_access_pointer(ze->rev)){
+        imrsim_zone_extents_free(ze);
+        return NULL;
     }
-    imrsim_init_zone_state_default(state_size);   // 初始化设备状态（zone_state）的基本信息
-    imrsim_dev_idle_init();      //设备空间初始化
-    return 0;
+    return ze;
 }
 
-/* read completion */
-static void imrsim_read_completion(struct bio *bio, int err)
+/* To get the position of the first of the nr extents starting after index. */
+static __u32 imrsim_extent_pos(struct imrsim_extent_array *arr, __u32 nr, __u32 index)
 {
-    if(err){
-        printk(KERN_ERR "imrsim: bio read err: %d\n", err);
-    }
-    if(bio){
-        complete((struct completion *)bio->bi_private);
+    __u32 lo = 0;
+    __u32 hi = nr;
+    __u32 mid;
+
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(READ_ONCE(arr->ext[mid].start) <= index){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
     }
+    return lo;
 }
 
-/* write completion */
-static void imrsim_write_completion(struct bio *bio, int err)
+/*
+ * To look index up in the extents, -1 if none holds it. Runs under the zone lock, or under
+ * RCU inside the seqcount of the zone, which a result read across an update fails.
+ */
+static int imrsim_extent_lookup(struct imrsim_extent_array *arr, __u32 index)
 {
-    if(err){
-        printk(KERN_ERR "imrsim: bio write err:%d\n", err);
+    __u32 nr = min_t(__u32, READ_ONCE(arr->nr), arr->max);
+    __u32 pos = imrsim_extent_pos(arr, nr, index);
+    struct imrsim_extent e;
+
+    if(!pos){
+        return -1;
     }
-    if(bio){
-        complete((struct completion *)bio->bi_private);
+    e = arr->ext[pos - 1];
+    if(index - e.start >= e.len){
+        return -1;
     }
+    return e.target + (index - e.start);
 }
 
-/* To get device mapping offset.获取device映射偏移量。 */
-static sector_t imrsim_map_sector(struct dm_target *ti, 
-                                  sector_t bi_sector)
+/* To make room for the two extents an update may add, the old array goes once the readers left it. */
+static int imrsim_extents_reserve(struct imrsim_extent_array __rcu **parr)
 {
-    struct imrsim_c *c = ti->private;  // dm_target-private:target specific data 
-    return c->start + dm_target_offset(ti, bi_sector);  // Sector offset taken relative to the start of the target instead of
-                                                        // relative to the start of the device.
-                                                        //根据target device的起始地址和该bio请求在mapped device设备上的偏移值
-                                                        //改变IO请求开始的扇区号bi_sector，从而完成IO请求的重定向
+    struct imrsim_extent_array *arr = rcu_dereference_protected(*parr, true);
+    struct imrsim_extent_array *new;
+
+    if(arr->nr + 2 <= arr->max){
+        return 0;
+    }
+    new = imrsim_extents_alloc(arr->max * 2, GFP_NOIO);
+    if(!new){
+        return -ENOMEM;
+    }
+    memcpy(new->ext, arr->ext, arr->nr * sizeof(arr->ext[0]));
+    new->nr = arr->nr;
+    rcu_assign_pointer(*parr, new);
+    kvfree_rcu(arr, rcu);
+    return 0;
 }
 
-/* read page (for meta-data) 读取页面（用于元数据）*/
-static int imrsim_read_page(struct block_device *dev, sector_t lba,
-                            int size, struct page *page)
+/*
+ * To unmap index, the extent holding it may be split in two. index is mapped. The caller
+ * holds the zone lock inside a write of its seqcount.
+ */
+static void imrsim_extent_erase(struct imrsim_extent_array *arr, __u32 index)
 {
-    //dump_stack();   // #include<asm/ptrace.h> Debugging: View function call stacks
-    int ret = 0;
-    struct bio *bio = bio_alloc(GFP_NOIO, 1); //bio初始化
+    __u32 pos = imrsim_extent_pos(arr, arr->nr, index);
+    struct imrsim_extent *e;
+    __u32 off;
 
-    if(!bio){
-        printk(KERN_ERR "imrsim: %s bio_alloc failed\n", __FUNCTION__);
-        return -EFAULT;
+    if(WARN_ON_ONCE(!pos || index - arr->ext[pos - 1].start >= arr->ext[pos - 1].len)){
+        return;
     }
-    bio->bi_bdev = dev;  //存放对应的块设备
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
-    bio->bi_sector = lba;
-    #else
-    bio->bi_iter.bi_sector = lba;   //请求的逻辑块地址，lba以扇区为单位
-    #endif
-    bio_add_page(bio, page, size, 0);
-    init_completion(&imrsim_completion.read_event);
-    bio->bi_private = &imrsim_completion.read_event;
-    bio->bi_end_io = imrsim_read_completion;
-    submit_bio(READ | REQ_SYNC, bio);
-    wait_for_completion(&imrsim_completion.read_event);
-    ret = test_bit(BIO_UPTODATE, &bio->bi_flags);//返回位的当前值
-    if(!ret){
-        printk(KERN_ERR "imrsim: pstore bio read failed\n");
-        ret = -EIO;
+    e = &arr->ext[pos - 1];
+    off = index - e->start;
+
+    if(off + 1 < e->len){   // the blocks after index make a new extent
+        memmove(&arr->ext[pos + 1], &arr->ext[pos], (arr->nr - pos) * sizeof(*e));
+        arr->ext[pos].start = index + 1;
+        arr->ext[pos].target = e->target + off + 1;
+        arr->ext[pos].len = e->len - off - 1;
+        WRITE_ONCE(arr->nr, arr->nr + 1);
+    }
+    e->len = off;
+    if(!off){
+        memmove(e, e + 1, (arr->nr - pos) * sizeof(*e));
+        WRITE_ONCE(arr->nr, arr->nr - 1);
     }
-    bio_put(bio);
-    return ret;
 }
 
-/* write page (for meta-data) 写页（用于元数据）*/
-static int imrsim_write_page(struct block_device *dev, sector_t lba,
-                            __u32 size, struct page *page)
+/*
+ * To map index to target, merged with the extents it follows or precedes. index is not
+ * mapped. The caller holds the zone lock inside a write of its seqcount.
+ */
+static void imrsim_extent_insert(struct imrsim_extent_array *arr, __u32 index, __u32 target)
 {
-    int ret = 0;
-    struct bio *bio = bio_alloc(GFP_NOIO, 1);
+    __u32 pos = imrsim_extent_pos(arr, arr->nr, index);
+    struct imrsim_extent *prev = pos ? &arr->ext[pos - 1] : NULL;
+    struct imrsim_extent *next = pos < arr->nr ? &arr->ext[pos] : NULL;
 
-    if(!bio){
-        printk(KERN_ERR "imrsim: %s bio_alloc failed\n", __FUNCTION__);
-        return -EFAULT;
+    if(next && (next->start != index + 1 || next->target != target + 1)){
+        next = NULL;
     }
-    bio->bi_bdev = dev;
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
-    bio->bi_sector = lba;
-    #else
-    bio->bi_iter.bi_sector = lba;
-    #endif
-    bio_add_page(bio, page, size, 0);
-    init_completion(&imrsim_completion.write_event);
-    bio->bi_private = &imrsim_completion.write_event;
-    bio->bi_end_io = imrsim_write_completion;
-    submit_bio(WRITE_FLUSH_FUA, bio);
-    wait_for_completion(&imrsim_completion.write_event);
-    ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
-    if(!ret){
-        printk(KERN_ERR "imrsim: pstore bio write failed\n");
-        ret = -EIO;
+    if(prev && prev->start + prev->len == index && prev->target + prev->len == target){
+        prev->len++;
+        if(next){   // index fills the gap between two extents
+            prev->len += next->len;
+            memmove(next, next + 1, (arr->nr - pos - 1) * sizeof(*next));
+            WRITE_ONCE(arr->nr, arr->nr - 1);
+        }
+    }else if(next){
+        next->start--;
+        next->target--;
+        next->len++;
+    }else{
+        memmove(&arr->ext[pos + 1], &arr->ext[pos], (arr->nr - pos) * sizeof(arr->ext[0]));
+        arr->ext[pos].start = index;
+        arr->ext[pos].target = target;
+        arr->ext[pos].len = 1;
+        WRITE_ONCE(arr->nr, arr->nr + 1);
     }
-    bio_put(bio);  //bio_put()函数减少bio中引用计数器(bi_cnt)的值，如果该值等于0，则释放bio结构以及相关的bio_vec结构。
-    return ret;
 }
 
-/* End event for rmw bio */
-/*rmw bio 的结束事件*/
-static void imrsim_end_rmw(struct bio *bio, int err)
+/* To lay the extents of one direction out in the bitmap and the array of a block mapping table. */
+static void imrsim_extents_to_map(struct imrsim_extent_array *arr, unsigned long *bits, __u16 *to)
 {
-    int i;
-    //struct bio_vec *bvec;
+    __u32 i;
+    __u32 k;
 
-    if(bio){
-        // if(bio_data_dir(bio) == WRITE){
-        //     printk(KERN_INFO "imrsim: release pages.\n");
-        //     bio_for_each_segment_all(bvec, bio, i)
-        //         __free_page(bvec->bv_page);
-        // }
-        // if(bio_data_dir(bio) == READ){
-        //     printk(KERN_INFO "imrsim: read bio end.\n");
-        // }
-        complete((struct completion *)bio->bi_private);   // rmw 同步控制。发送完成量，唤醒一个等待
-        bio_put(bio);
+    for(i = 0; i < arr->nr; i++){
+        bitmap_set(bits, arr->ext[i].start, arr->ext[i].len);
+        for(k = 0; k < arr->ext[i].len; k++){
+            to[arr->ext[i].start + k] = arr->ext[i].target + k;
+        }
     }
 }
 
-/* rmw task - sub thread*/
-/*rmw 任务 -子线程 */
-int read_modify_write_task(void *arg)
+/* To build the extents of one direction of a block mapping table. */
+static struct imrsim_extent_array *imrsim_extents_from_map(const unsigned long *bits, const __u16 *to)
 {
-    
-    struct dm_target * ti = (struct dm_target *)arg;
-    struct imrsim_c *c = ti->private;
-    __u8 i;
-    __u8 n = imrsim_rmw_task.lba_num;//从mrsim_write_rule_check函数接收imrsim_rmw_task.lba_num
-    struct page *pages[2];
-    void  *page_addrs[2];
+    struct imrsim_extent_array *arr;
+    struct imrsim_extent *e = NULL;
+    __u32 nr = 0;
+    __u32 i;
 
-    if(imrsim_rmw_task.bio)
-    {
-        printk(KERN_INFO "imrsim: enter rmw process and back up\n");
-        // read the blocks needed to back up  读取需要备份块
-        for(i=0; i<n; i++)
-        {
-            pages[i] = alloc_page(GFP_KERNEL);  //alloc_page(GFP_KERNEL,3) 分配2^3个物理页
-            if(!pages[i]){
-                printk(KERN_ERR "imrsim: no enough memory to allocate a page\n");
-                return -ENOMEM;
-            }
-            page_addrs[i] = page_address(pages[i]);
-            if(!page_addrs[i]){
-                printk(KERN_ERR "imrsim: read page vm addr null\n");
-                __free_page(pages[i]);
-            }
-            //printk(KERN_INFO "imrsim: page_addr:0x%lx\n", page_addrs[i]);
-            memset(page_addrs[i], 0, PAGE_SIZE);
-            struct bio *rbio = bio_alloc(GFP_NOIO, 1);
-            init_completion(&imrsim_completion.read_event);
-            rbio->bi_private = &imrsim_completion.read_event;
-            rbio->bi_bdev = c->dev->bdev;
-            rbio->bi_iter.bi_sector = imrsim_map_sector(ti, imrsim_rmw_task.lba[i]);//根据相邻顶部磁道的位置映射rmw位置
-            rbio->bi_end_io = imrsim_end_rmw;
-            bio_add_page(rbio, pages[i], PAGE_SIZE, 0);
-            submit_bio(READ | REQ_SYNC, rbio);
-            wait_for_completion(&imrsim_completion.read_event);
-            cond_resched();
-        }
-
-        printk(KERN_INFO "imrsim: write bio.\n");
-        // write current bio  写当前bio
-        submit_bio(WRITE_FUA, imrsim_rmw_task.bio);
-        cond_resched();
-
-        printk(KERN_INFO "imrsim: write back.\n");
-        // write back  回写。
-        //如果修改rmw策略为mom，则写回位置应该通过计算寻找一个较为cold磁道中的位置。
-        //即imrsim_rmw_task.lba[i])应该重新通过算法计算得到。
-        for(i=0; i<n; i++)
-        {
-            struct bio *wbio = bio_alloc(GFP_NOIO, 1);
-            init_completion(&imrsim_completion.write_event);
-            wbio->bi_private = &imrsim_completion.write_event;
-            wbio->bi_bdev = c->dev->bdev;
-            wbio->bi_iter.bi_sector = imrsim_map_sector(ti, imrsim_rmw_task.lba[i]);
-            wbio->bi_end_io = imrsim_end_rmw;
-            bio_add_page(wbio, pages[i], PAGE_SIZE, 0);
-            submit_bio(WRITE_FUA, wbio);
-            wait_for_completion(&imrsim_completion.write_event);
-            cond_resched();
-        }
-
-        // release pages  释放页
-        for(i=0; i<n; i++)
-        {
-            __free_page(pages[i]);
+    for_each_set_bit(i, bits, TOTAL_ITEMS){
+        if(!i || !test_bit(i - 1, bits) || to[i] != to[i - 1] + 1){
+            nr++;
         }
-        printk(KERN_INFO "imrsim: release pages.\n");
-        imrsim_rmw_task.lba_num = 0;
-        complete(&imrsim_completion.rmw_event);   // rmw completion release
     }
-    return 0;
+    arr = imrsim_extents_alloc(max_t(__u32, nr, IMR_EXTENTS_MIN), GFP_NOIO);   // may run in the I/O path
+    if(!arr){
+        return NULL;
+    }
+    for_each_set_bit(i, bits, TOTAL_ITEMS){
+        if(e && e->start + e->len == i && e->target + e->len == to[i]){
+            e->len++;
+        }else{
+            e = &arr->ext[arr->nr++];
+            e->start = i;
+            e->target = to[i];
+            e->len = 1;
+        }
+    }
+    return arr;
 }
 
-/* RMW event caused by update to bottom track  底部磁道更新引起的RMW事件*/
-void imrsim_rmw_thread(struct dm_target *ti)
+/*
+ * To get the first sector of a copy of the state, each is followed by its table of the page
+ * crcs. The copies are sized for the default zones, the second one is found without the
+ * header of the first.
+ */
+static sector_t imrsim_state_lba(struct imrsim_c *c, __u32 copy)
 {
-    imrsim_rmw_task.task = kthread_create(read_modify_write_task, ti, "rmw thread");
-    if(imrsim_rmw_task.task){
-        printk(KERN_INFO "imrsim: rmw thread created : %d.\n", imrsim_rmw_task.task->pid);
-        init_completion(&imrsim_completion.rmw_event);  //初始化一个信号量
-        wake_up_process(imrsim_rmw_task.task);  //唤醒处于睡眠状态的进程
-        wait_for_completion(&imrsim_completion.rmw_event);  //等待信号量的释放
-        //kthread_stop(imrsim_rmw_task.task);
-        printk(KERN_INFO "imrsim: rmw task end.\n");
-    }
+    __u32 len = imrsim_state_size(c->nr_zones_default);
+
+    return c->ptask.pstore_lba
+         + (((sector_t)DIV_ROUND_UP(len, PAGE_SIZE) + imrsim_state_crc_pages(len)) << IMR_PAGE_SIZE_SHIFT_DEFAULT) * copy;
+}
+
+/* To get the first sector of the table of the page crcs of a copy, after its state. */
+static sector_t imrsim_state_crc_lba(struct imrsim_c *c, __u32 copy)
+{
+    return imrsim_state_lba(c, copy)
+         + (round_up(c->zone_state->header.length, PAGE_SIZE) >> IMR_SECTOR_SIZE_SHIFT_DEFAULT);
 }
 
+/* To get the first sector of the slot of the mapping table of a zone, after the copies of the state. */
+static sector_t imrsim_map_slot(struct imrsim_c *c, __u32 zone_idx)
+{
+    return imrsim_state_lba(c, IMR_STATE_COPIES) + (sector_t)zone_idx * IMR_MAP_SLOT_SECTORS;
+}
 
-/* To get page number and next page. */
-/*获取页码和下一页*/
-static __u32 imrsim_pstore_pg_idx(__u32 idx, __u32 *pg_nxt)
+/* To get the sectors of the metadata after the last of nr_zones zones: the copies of the state, the slots and the journal. */
+static sector_t imrsim_pstore_sectors(__u32 nr_zones)
 {
-    __u32 tmp = IMR_PSTORE_PG_OFF + sizeof(struct imrsim_zone_stats)*idx;
-    __u32 pg_cur = tmp / PAGE_SIZE;
+    __u32 len = imrsim_state_size(nr_zones);
 
-    *pg_nxt = tmp % PAGE_SIZE ? pg_cur+1 : pg_cur;
-    return pg_cur;
+    return ((((sector_t)DIV_ROUND_UP(len, PAGE_SIZE) + imrsim_state_crc_pages(len)) * IMR_STATE_COPIES
+             + IMR_JOURNAL_PAGES) << IMR_PAGE_SIZE_SHIFT_DEFAULT)
+         + (sector_t)nr_zones * IMR_MAP_SLOT_SECTORS;
 }
 
-/* Persistent storage - handled in a variety of cases depending on the type of metadata change.*/
-/*持久存储 -根据元数据更改的类型在各种情况下进行处理。*/
-static int imrsim_flush_persistence(struct dm_target *ti)//元数据同步磁盘
+/*
+ * To get a pointer to the byte at off in the slot of a zone, bp holds the page of the
+ * cache until it is released. NULL if the page cannot be read. A page missing from the
+ * cache is read synchronously, in map under the zone lock for a write.
+ */
+static void *imrsim_slot_get(struct imrsim_c *c, __u32 zone_idx, size_t off, struct dm_buffer **bp)
 {
-    void             *page_addr;
-    struct page      *page;
-    struct imrsim_c  *zdev;
-    __u32            idx;
-    __u32            crc;    
-    __u32            pg_cur;
-    __u32            pg_nxt;
-    __u32            qidx;
-
-    zdev = ti->private;
-    page = alloc_pages(GFP_KERNEL, 0);  //内存分配物理页面alloc_pages(gfp, order)，2的order次。GFP_KERNEL为掩码
-    if(!page){
-        printk(KERN_ERR "imrsim: no enough memory to allocate a page\n");
-        return -ENOMEM;
-    }
-    page_addr = page_address(page);
-    if(!page_addr){
-        printk(KERN_ERR "imrsim: write page vm addr null\n");
-        __free_pages(page, 0);
-        return -EINVAL;
-    }
-    crc = crc32(0, (unsigned char *)zone_state + sizeof(struct imrsim_state_header),//生成str的32位循环冗余校验码多项式。这通常用于检查传输的数据是否完整。
-                zone_state->header.length - sizeof(struct imrsim_state_header));
-    zone_state->header.crc32 = crc;
-    if(imrsim_ptask.flag &= IMR_CONFIG_CHANGE){
-        imrsim_ptask.flag &= ~IMR_CONFIG_CHANGE;
-    }
-    memcpy(page_addr, (unsigned char *)zone_state, PAGE_SIZE);
-    imrsim_write_page(zdev->dev->bdev, imrsim_ptask.pstore_lba, PAGE_SIZE, page);
+    sector_t block = (imrsim_map_slot(c, zone_idx) >> (PAGE_SHIFT - SECTOR_SHIFT)) + off / PAGE_SIZE;
+    unsigned char *data = dm_bufio_read(c->bufio, block, bp);
 
-    /* Handling of Disk Statistics Changes. */
-    if(imrsim_ptask.flag &= IMR_STATS_CHANGE){
-        imrsim_ptask.flag &= ~IMR_STATS_CHANGE;
-        if(imrsim_ptask.sts_zone_idx > IMR_PSTORE_PG_EDG){
-            pg_cur = imrsim_pstore_pg_idx(imrsim_ptask.sts_zone_idx, &pg_nxt);
-            imrsim_ptask.sts_zone_idx = 0;
-            for(idx = pg_cur; idx <= pg_nxt; idx++){
-                memcpy(page_addr, ((unsigned char *)zone_state + idx * PAGE_SIZE), PAGE_SIZE);
-                imrsim_write_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                                (idx << IMR_PAGE_SIZE_SHIFT_DEFAULT),
-                                PAGE_SIZE, page);
-            }
+    if(IS_ERR(data)){
+        if(printk_ratelimit()){
+            printk(KERN_ERR "imrsim: cannot read the mapping table of zone %u: %ld\n",
+                   zone_idx, PTR_ERR(data));
         }
+        *bp = NULL;
+        return NULL;
     }
+    return data + off % PAGE_SIZE;
+}
+
+/* To clear the bitmaps of the slot of a zone, its stale entries are then never looked at. */
+static int imrsim_slot_clear(struct imrsim_c *c, __u32 zone_idx)
+{
+    static const size_t bitmaps[] = {
+        offsetof(struct imrsim_zone_map, mapped),
+        offsetof(struct imrsim_zone_map, used),
+    };
+    sector_t first = imrsim_map_slot(c, zone_idx) >> (PAGE_SHIFT - SECTOR_SHIFT);
+    struct dm_buffer *bp;
+    void *data;
+    size_t off;
+    int i;
 
-    /* Handling of disk state changes. */
-    if(imrsim_ptask.flag &= IMR_STATUS_CHANGE){
-        imrsim_ptask.flag &= ~IMR_STATUS_CHANGE;
-        for(qidx = 0; qidx < imrsim_ptask.stu_zone_idx_cnt; qidx++){
-            pg_cur = imrsim_pstore_pg_idx(imrsim_ptask.stu_zone_idx[qidx], &pg_nxt);
-            imrsim_ptask.stu_zone_idx[qidx] = 0;
-            for(idx = pg_cur; idx <= pg_nxt; idx++){
-                memcpy(page_addr, ((unsigned char *)zone_state + idx * PAGE_SIZE), PAGE_SIZE);
-                imrsim_write_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                                (idx << IMR_PAGE_SIZE_SHIFT_DEFAULT),
-                                PAGE_SIZE, page);
+    for(i = 0; i < ARRAY_SIZE(bitmaps); i++){
+        for(off = round_down(bitmaps[i], PAGE_SIZE); off < bitmaps[i] + BITS_TO_LONGS(TOTAL_ITEMS) * sizeof(long);
+            off += PAGE_SIZE){
+            data = dm_bufio_new(c->bufio, first + off / PAGE_SIZE, &bp);
+            if(IS_ERR(data)){
+                return PTR_ERR(data);
             }
+            memset(data, 0, PAGE_SIZE);
+            dm_bufio_mark_buffer_dirty(bp);
+            dm_bufio_release(bp);
         }
-        imrsim_ptask.stu_zone_idx_cnt = 0;
-        imrsim_ptask.stu_zone_idx_gap = 0;
     }
-
-    if(imrsim_dbg_log_enabled && printk_ratelimit()){
-        printk(KERN_ERR "imrsim: flush persist success\n");
-    }
-    __free_pages(page, 0);
     return 0;
 }
 
-/* To persist meta-data. */
-/*持久化元数据*/
-static int imrsim_save_persistence(struct dm_target *ti)
+/* To allocate the mapping table of a zone on its first write, the caller holds the zone lock. */
+static int imrsim_zone_map_alloc(struct imrsim_c *c, __u32 zone_idx)
 {
-    void             *page_addr;
-    struct page      *page;
-    struct imrsim_c  *zdev;
-    __u32            num_pages;
-    __u32            part_page;
-    __u32            idx;
-    __u32            crc;
+    struct imrsim_zone_extents *ze;
 
-    zdev = ti->private;
-    page = alloc_pages(GFP_KERNEL, 0);
-    if(!page){
-        printk(KERN_ERR "imrsim: no enough memory to allocate a page\n");
-        return -ENOMEM;
-    }
-    page_addr = page_address(page);
-    if(!page_addr){
-        printk(KERN_ERR "imrsim: write page vm addr null\n");
-        __free_pages(page, 0);
-        return -EINVAL;
+    // the reads see the table once it is cleared
+    if(c->map_mode == IMR_MAP_EXTENT){
+        if(!c->zone_extents[zone_idx]){
+            ze = imrsim_zone_extents_alloc(0, 0, GFP_NOIO);
+            if(!ze){
+                return -ENOMEM;
+            }
+            smp_store_release(&c->zone_extents[zone_idx], ze);
+        }
+        return 0;
     }
-    num_pages = div_u64_rem(zone_state->header.length, PAGE_SIZE, &part_page);
-    crc = crc32(0, (unsigned char *)zone_state + sizeof(struct imrsim_state_header),
-                zone_state->header.length - sizeof(struct imrsim_state_header));
-    zone_state->header.crc32 = crc;
-    for(idx = 0; idx < num_pages; idx++){
-        memcpy(page_addr, ((unsigned char *)zone_state + 
-               idx * PAGE_SIZE), PAGE_SIZE);
-        imrsim_write_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                         (idx << IMR_PAGE_SIZE_SHIFT_DEFAULT), PAGE_SIZE, page);
-    }
-    if(part_page){
-        memcpy(page_addr, ((unsigned char *)zone_state + 
-              num_pages * PAGE_SIZE), part_page);
-        imrsim_write_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                          (num_pages << IMR_PAGE_SIZE_SHIFT_DEFAULT), PAGE_SIZE, page);
-    }
-    if(imrsim_dbg_log_enabled && printk_ratelimit()){
-        printk(KERN_INFO "imrsim: save persist success\n");
+    // the reads do not look at the slot before z_map_size grows
+    if(!c->zone_status[zone_idx].z_map_size){
+        return imrsim_slot_clear(c, zone_idx);
     }
-    __free_pages(page, 0);
     return 0;
 }
 
-/* To load metadata from persistent storage. */
-static int imrsim_load_persistence(struct dm_target *ti)
+/*
+ * To drop the mapping tables of all the zones, the array is resized to nr zones. In block
+ * mode the cached pages of the slots are written and dropped, only the zones to check on
+ * their first access are tracked.
+ */
+static int imrsim_reset_zone_maps(struct imrsim_c *c, __u32 nr)
+{
+    struct imrsim_zone_extents **extents = c->zone_extents;
+    struct imrsim_zone_extents **shadow = c->maps_shadow;
+    unsigned long *dirty = c->maps_dirty;
+    unsigned long *lazy = c->maps_lazy;
+    __u32 i;
+
+    if(c->bufio){
+        if(nr != c->nr_maps){
+            lazy = nr ? bitmap_zalloc(nr, GFP_KERNEL) : NULL;
+            if(nr && !lazy){
+                printk(KERN_ERR "imrsim: memory alloc failed for the mapping tables\n");
+                return -ENOMEM;
+            }
+            dm_bufio_write_dirty_buffers(c->bufio);
+            dm_bufio_forget_buffers(c->bufio, 0, dm_bufio_get_device_size(c->bufio));
+            bitmap_free(c->maps_lazy);
+            c->maps_lazy = lazy;
+            c->nr_maps = nr;
+        }else if(nr){
+            bitmap_zero(c->maps_lazy, nr);
+        }
+        return 0;
+    }
+    if(nr != c->nr_maps){
+        extents = NULL;
+        shadow = NULL;
+        dirty = NULL;
+        lazy = NULL;
+        if(nr){
+            extents = kvcalloc(nr, sizeof(*extents), GFP_KERNEL);
+            shadow = kvcalloc(nr, sizeof(*shadow), GFP_KERNEL);
+            dirty = bitmap_zalloc(nr, GFP_KERNEL);
+            lazy = bitmap_zalloc(nr, GFP_KERNEL);
+            if(!extents || !shadow || !dirty || !lazy){
+                kvfree(extents);
+                kvfree(shadow);
+                bitmap_free(dirty);
+                bitmap_free(lazy);
+                printk(KERN_ERR "imrsim: memory alloc failed for the mapping tables\n");
+                return -ENOMEM;
+            }
+        }
+    }
+    for(i = 0; i < c->nr_maps; i++){
+        imrsim_zone_extents_free(c->zone_extents[i]);
+        c->zone_extents[i] = NULL;
+    }
+    if(nr != c->nr_maps){
+        kvfree(c->zone_extents);
+        kvfree(c->maps_shadow);
+        bitmap_free(c->maps_dirty);
+        bitmap_free(c->maps_lazy);
+        c->zone_extents = extents;
+        c->maps_shadow = shadow;
+        c->maps_dirty = dirty;
+        c->maps_lazy = lazy;
+        c->nr_maps = nr;
+    }else if(nr){
+        bitmap_zero(c->maps_dirty, nr);
+        bitmap_zero(c->maps_lazy, nr);
+    }
+    return 0;
+}
+
+/* To account a write and the extra writes it causes in the device-wide counters. */
+static void imrsim_dev_stats_write(struct imrsim_c *c, __u32 extra)
+{
+    spin_lock(&c->stats_lock);
+    c->zone_state->stats.write_total += 1 + extra;
+    c->zone_state->stats.extra_write_total += extra;
+    spin_unlock(&c->stats_lock);
+}
+
+/* Device idle time initialization. */
+static void imrsim_dev_idle_init(struct imrsim_c *c)
+{
+    c->idle_checkpoint = jiffies;
+    c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = 0;
+    c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = jiffies / HZ;
+}
+
+/* Basic information for initializing zone. */
+static void imrsim_init_zone_default(struct imrsim_c *c, __u64 sizedev)   /* sizedev: in sectors */ //siedev以sector为单位
+{
+    c->capacity = sizedev;
+    c->zone_size_shift = IMR_ZONE_SIZE_SHIFT_DEFAULT;
+    c->block_size_shift = IMR_BLOCK_SIZE_SHIFT_DEFAULT;
+    c->nr_zones = (c->capacity >> c->block_size_shift >> c->zone_size_shift);
+    c->nr_zones_default = c->nr_zones;
+    printk(KERN_INFO "imrsim_init_zone_state: numzones=%d sizedev=%llu\n",
+        c->nr_zones, sizedev); 
+}
+
+static void __imrsim_reset_stats(struct imrsim_c *c);
+
+/* To give a zone its default status, nothing mapped. */
+static void imrsim_init_zone_status(struct imrsim_c *c, __u32 zone_idx)
+{
+    c->zone_status[zone_idx].z_start = zone_idx;
+    c->zone_status[zone_idx].z_length = num_sectors_zone(c);
+    c->zone_status[zone_idx].z_type = Z_TYPE_CONVENTIONAL;
+    c->zone_status[zone_idx].z_conds = Z_COND_NO_WP;
+    c->zone_status[zone_idx].z_flag = 0;
+    c->zone_status[zone_idx].z_map_size = 0;
+}
+
+/* Basic information for initializing the device state (zone_state) */
+/*磁盘统计信息*/
+static void imrsim_init_zone_state_default(struct imrsim_c *c, __u32 state_size)
+{
+    __u32 i;
+    __u32 *magic;   /* magic number to identify the device (equipment identity) */
+
+    /* head info. */
+    c->zone_state->header.magic = 0xBEEFBEEF;
+    c->zone_state->header.length = state_size;
+    c->zone_state->header.version = VERSION;
+    c->zone_state->header.crc32 = 0;
+    c->zone_state->header.seq = get_random_u32();   // the journal of an older state never matches
+
+    /* config info. */
+    c->zone_state->config.dev_config.out_of_policy_read_flag = 0;
+    c->zone_state->config.dev_config.out_of_policy_write_flag = 0;
+    c->zone_state->config.dev_config.r_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
+    c->zone_state->config.dev_config.w_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
+
+    c->zone_state->stats.num_zones = c->nr_zones;
+    c->zone_state->stats.extra_write_total = 0;
+    c->zone_state->stats.write_total = 0;
+    __imrsim_reset_stats(c);  
+    /* To allocate space for the zone_status array and initialize it. */
+    /*为 zone_status 数组分配空间并初始化它。*/
+    imrsim_state_layout(c, c->nr_zones);
+    for(i=0; i<c->nr_zones; i++){
+        imrsim_init_zone_status(c, i);
+    }
+    memset(c->zone_tracks, 0, (size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+    printk(KERN_INFO "imrsim: %s zone_status init!\n", __FUNCTION__);
+    magic = (__u32 *)&c->zone_tracks[(size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL];
+    *magic = 0xBEEFBEEF;
+}
+
+/* To initial a device. */
+int imrsim_init_zone_state(struct imrsim_c *c, __u64 sizedev)
+{
+    __u64 state_size;
+
+    if(!sizedev){
+        printk(KERN_ERR "imrsim: zero capacity detected\n");
+        return -EINVAL;
+    }
+    imrsim_init_zone_default(c, sizedev);     /* Initialize the basic information of the zone.初始化zone的基本信息 */
+    state_size = imrsim_state_size(c->nr_zones);  // 获取imrsim_state结构的大小
+    /* Allocate memory space for zone_state, the one it already has is reclaimed. */
+    if(imrsim_state_realloc(c, state_size)){
+        printk(KERN_ERR "imrsim: memory alloc failed for zone state\n");
+        return -ENOMEM;
+    }
+    if(imrsim_reset_zone_maps(c, c->nr_zones)){
+        return -ENOMEM;
+    }
+    imrsim_init_zone_state_default(c, state_size);   // 初始化设备状态（zone_state）的基本信息
+    imrsim_dev_idle_init(c);      //设备空间初始化
+    return 0;
+}
+
+/* read completion */
+static void imrsim_read_completion(struct bio *bio)
+{
+    if(bio->bi_status){
+        printk(KERN_ERR "imrsim: bio read err: %d\n", blk_status_to_errno(bio->bi_status));
+    }
+    if(bio){
+        complete((struct completion *)bio->bi_private);
+    }
+}
+
+/* To get device mapping offset.获取device映射偏移量。 */
+static sector_t imrsim_map_sector(struct dm_target *ti, 
+                                  sector_t bi_sector)
+{
+    struct imrsim_c *c = ti->private;  // dm_target-private:target specific data 
+    return c->start + dm_target_offset(ti, bi_sector);  // Sector offset taken relative to the start of the target instead of
+                                                        // relative to the start of the device.
+                                                        //根据target device的起始地址和该bio请求在mapped device设备上的偏移值
+                                                        //改变IO请求开始的扇区号bi_sector，从而完成IO请求的重定向
+}
+
+/* read page (for meta-data) 读取页面（用于元数据）*/
+static int imrsim_read_page(struct imrsim_c *c, struct block_device *dev, sector_t lba,
+                            int size, struct page *page)
+{
+    //dump_stack();   // #include<asm/ptrace.h> Debugging: View function call stacks
+    int ret = 0;
+    struct bio *bio = bio_alloc_bioset(dev, 1, REQ_OP_READ | REQ_SYNC, GFP_NOIO,
+                                       &c->io_bio_set); //bio初始化，dev为对应的块设备
+
+    if(!bio){
+        printk(KERN_ERR "imrsim: %s bio_alloc failed\n", __FUNCTION__);
+        return -EFAULT;
+    }
+    bio->bi_iter.bi_sector = lba;   //请求的逻辑块地址，lba以扇区为单位
+    bio_add_page(bio, page, size, 0);
+    init_completion(&c->completion.read_event);
+    bio->bi_private = &c->completion.read_event;
+    bio->bi_end_io = imrsim_read_completion;
+    submit_bio(bio);
+    wait_for_completion(&c->completion.read_event);
+    ret = !bio->bi_status;
+    if(!ret){
+        printk(KERN_ERR "imrsim: pstore bio read failed\n");
+        ret = -EIO;
+    }
+    bio_put(bio);
+    return ret;
+}
+
+/* meta-data read/write completion */
+static void imrsim_md_end_io(struct bio *bio)
+{
+    struct imrsim_md_io *io = bio->bi_private;
+
+    if(bio->bi_status){
+        printk(KERN_ERR "imrsim: pstore bio err:%d\n", blk_status_to_errno(bio->bi_status));
+        WRITE_ONCE(io->error, bio->bi_status);
+    }
+    bio_put(bio);
+    if(atomic_dec_and_test(&io->pending)){
+        complete(&io->done);
+    }
+}
+
+static void imrsim_md_init(struct imrsim_md_io *io)
+{
+    atomic_set(&io->pending, 1);
+    io->error = BLK_STS_OK;
+    init_completion(&io->done);
+}
+
+/*
+ * To read or write nr pages of a buffer at lba without waiting, in bios of up to
+ * BIO_MAX_VECS pages built on the pages of the buffer itself. The buffer stays as it
+ * is until the bios are waited for.
+ */
+static void imrsim_md_submit(struct imrsim_c *c, struct imrsim_md_io *io, blk_opf_t opf, sector_t lba,
+                             const void *addr, __u32 nr)
+{
+    const unsigned char *p = addr;
+    struct bio *bio;
+    __u32 n;
+    __u32 i;
+
+    while(nr){
+        n = min_t(__u32, nr, BIO_MAX_VECS);
+        bio = bio_alloc_bioset(c->dev->bdev, n, opf | REQ_SYNC, GFP_NOIO, &c->io_bio_set);
+        bio->bi_iter.bi_sector = lba;
+        for(i = 0; i < n; i++, p += PAGE_SIZE){
+            __bio_add_page(bio, is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p), PAGE_SIZE, 0);
+        }
+        bio->bi_private = io;
+        bio->bi_end_io = imrsim_md_end_io;
+        atomic_inc(&io->pending);
+        submit_bio(bio);
+        lba += (sector_t)n << IMR_PAGE_SIZE_SHIFT_DEFAULT;
+        nr -= n;
+    }
+}
+
+static void imrsim_md_write(struct imrsim_c *c, struct imrsim_md_io *io, sector_t lba,
+                            const void *addr, __u32 nr)
+{
+    imrsim_md_submit(c, io, REQ_OP_WRITE, lba, addr, nr);
+}
+
+static void imrsim_md_read(struct imrsim_c *c, struct imrsim_md_io *io, sector_t lba,
+                           void *addr, __u32 nr)
+{
+    imrsim_md_submit(c, io, REQ_OP_READ, lba, addr, nr);
+}
+
+/*
+ * To wait for the bios submitted on io, which can take more bios after it. With flush,
+ * a single flush of the device makes the writes durable.
+ */
+static int imrsim_md_wait(struct imrsim_c *c, struct imrsim_md_io *io, int flush)
+{
+    int ret;
+
+    if(!atomic_dec_and_test(&io->pending)){
+        wait_for_completion(&io->done);
+    }
+    ret = blk_status_to_errno(io->error);
+    imrsim_md_init(io);
+    if(ret){
+        printk(KERN_ERR "imrsim: pstore bio failed\n");
+        return ret;
+    }
+    return flush ? blkdev_issue_flush(c->dev->bdev) : 0;
+}
+
+/* To give the pages of a batch back to the pool, also from the bio completion. */
+static void imrsim_rmw_free_pages(struct imrsim_c *c, struct imrsim_rmw_batch *batch)
+{
+    __u32 topno;
+    __u8 k;
+
+    for(k = 0; k < 2; k++){
+        for_each_set_bit(topno, batch->top[k], TOP_TRACK_SIZE){
+            if(batch->pages[k][topno]){
+                mempool_free(batch->pages[k][topno], c->page_pool);
+                batch->pages[k][topno] = NULL;
+            }
+        }
+    }
+}
+
+/*
+ * To take the pages of the backup of a batch from the pool without waiting for them,
+ * false if it is short of them. None of them is kept then.
+ */
+static bool imrsim_rmw_alloc_pages(struct imrsim_c *c, struct imrsim_rmw_batch *batch)
+{
+    __u32 topno;
+    __u8 k;
+    bool ok = true;
+
+    mutex_lock(&c->rmw_page_lock);
+    for(k = 0; k < 2 && ok; k++){
+        for_each_set_bit(topno, batch->top[k], TOP_TRACK_SIZE){
+            batch->pages[k][topno] = mempool_alloc(c->page_pool, GFP_NOWAIT | __GFP_NOWARN);
+            if(!batch->pages[k][topno]){
+                ok = false;
+                break;
+            }
+        }
+    }
+    mutex_unlock(&c->rmw_page_lock);
+    if(!ok){
+        imrsim_rmw_free_pages(c, batch);
+    }
+    return ok;
+}
+
+/* To drop a reference on the current RMW stage, the last one queues the next stage. */
+static void imrsim_rmw_put(struct imrsim_rmw_batch *batch)
+{
+    struct imrsim_c *c = batch->ti->private;
+
+    if(atomic_dec_and_test(&batch->pending)){
+        // the pages are needed no more once written back, they do not wait for the workqueue
+        if(batch->error || batch->stage == IMR_RMW_WRITEBACK){
+            imrsim_rmw_free_pages(c, batch);
+        }
+        batch->stage = batch->error ? IMR_RMW_DONE : batch->stage + 1;
+        queue_delayed_work(c->rmw_wq, &batch->dwork, 0);
+    }
+}
+
+/* End event for rmw bio */
+/*rmw bio 的结束事件*/
+static void imrsim_end_rmw(struct bio *bio)
+{
+    struct imrsim_rmw_batch *batch = bio->bi_private;
+
+    if(bio->bi_status){
+        printk(KERN_ERR "imrsim: rmw bio err: %d\n", blk_status_to_errno(bio->bi_status));
+        batch->error = bio->bi_status;
+    }
+    bio_put(bio);
+    imrsim_rmw_put(batch);
+}
+
+/* To get the sector of a top-track block of the batch, k is 0 for trackno and 1 for trackno+1. */
+static sector_t imrsim_rmw_sector(struct imrsim_rmw_batch *batch, __u8 k, __u32 topno)
+{
+    struct imrsim_c *c = batch->ti->private;
+
+    return zone_idx_lba(c, batch->zone_idx)
+        + (((batch->trackno + k) * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) + topno)
+        << c->block_size_shift);
+}
+
+/* To submit the backup reads or the write backs of a neighbor track, one bio per run of blocks. */
+static void imrsim_rmw_submit(struct imrsim_rmw_batch *batch, __u8 k, blk_opf_t opf)
+{
+    struct imrsim_c *c = batch->ti->private;
+    struct bio *bio;
+    unsigned long start;
+    unsigned long end = 0;
+
+    while((start = find_next_bit(batch->top[k], TOP_TRACK_SIZE, end)) < TOP_TRACK_SIZE){
+        end = find_next_zero_bit(batch->top[k], TOP_TRACK_SIZE, start);
+        while(start < end){
+            bio = bio_alloc_bioset(c->dev->bdev, min_t(unsigned long, end - start, BIO_MAX_VECS),
+                                   opf, GFP_NOIO, &c->io_bio_set);
+            bio->bi_iter.bi_sector = imrsim_map_sector(batch->ti, imrsim_rmw_sector(batch, k, start));//根据相邻顶部磁道的位置映射rmw位置
+            bio->bi_end_io = imrsim_end_rmw;
+            bio->bi_private = batch;
+            // the queue limits may stop the bio early, the rest of the run goes in the next one
+            while(start < end && bio_add_page(bio, batch->pages[k][start], PAGE_SIZE, 0) == PAGE_SIZE){
+                start++;
+            }
+            if(!bio->bi_vcnt){
+                printk(KERN_ERR "imrsim: %s bio_add_page failed\n", __FUNCTION__);
+                bio_put(bio);
+                batch->error = BLK_STS_IOERR;
+                return;
+            }
+            atomic_inc(&batch->pending);
+            submit_bio(bio);
+        }
+    }
+}
+
+/* To submit the flush ending a RMW. */
+static void imrsim_rmw_flush(struct imrsim_rmw_batch *batch)
+{
+    struct imrsim_c *c = batch->ti->private;
+    struct bio *bio = bio_alloc_bioset(c->dev->bdev, 0, REQ_OP_WRITE | REQ_PREFLUSH, GFP_NOIO,
+                                       &c->io_bio_set);
+
+    bio->bi_end_io = imrsim_end_rmw;
+    bio->bi_private = batch;
+    atomic_inc(&batch->pending);
+    submit_bio(bio);
+}
+
+/* To find the batch gathering the writes of a track group, the caller holds batcher.lock. */
+static struct imrsim_rmw_batch *imrsim_rmw_find(struct imrsim_c *c, __u32 zone_idx, __u32 trackno, __u8 open)
+{
+    struct imrsim_rmw_batch *batch;
+
+    list_for_each_entry(batch, &c->batcher.batches, list){
+        if(batch->zone_idx == zone_idx && batch->trackno == trackno &&
+           (batch->stage == IMR_RMW_COLLECT) == open){
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+/* To check whether a top-track write covers a block the batch backs up. */
+static bool imrsim_rmw_overlaps(struct imrsim_rmw_batch *batch, struct imrsim_top_write *top)
+{
+    __u8 k;
+
+    if(batch->zone_idx != top->zone_idx){
+        return false;
+    }
+    for(k = 0; k < 2; k++){
+        if(batch->trackno + k == top->trackno &&
+           find_next_bit(batch->top[k], top->first + top->nr, top->first) < top->first + top->nr){
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * To start a top-track write, the caller holds batcher.lock. A batch past its window
+ * would write its backup over the write, it holds the bio until it is done. Otherwise
+ * the write is in flight until imrsim_end_io and no backup of its blocks is read
+ * meanwhile. Returns true if a batch holds the bio.
+ */
+static bool imrsim_top_write_start(struct imrsim_c *c, struct imrsim_top_write *top, struct bio *bio)
+{
+    struct imrsim_rmw_batch *batch;
+
+    list_for_each_entry(batch, &c->batcher.batches, list){
+        if(batch->stage != IMR_RMW_COLLECT && imrsim_rmw_overlaps(batch, top)){
+            bio_list_add(&batch->waiters, bio);
+            return true;
+        }
+    }
+    list_add_tail(&top->list, &c->batcher.writes);
+    return false;
+}
+
+/* The last top-track write a backup waits for lets it start, called in the bio completion. */
+static void imrsim_top_write_end(struct imrsim_c *c, struct imrsim_top_write *top)
+{
+    struct imrsim_rmw_batch *batch;
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->batcher.lock, flags);
+    list_del_init(&top->list);
+    list_for_each_entry(batch, &c->batcher.batches, list){
+        if(batch->stage == IMR_RMW_BACKUP && batch->nr_writes &&
+           imrsim_rmw_overlaps(batch, top) && !--batch->nr_writes){
+            queue_delayed_work(c->rmw_wq, &batch->dwork, 0);
+        }
+    }
+    spin_unlock_irqrestore(&c->batcher.lock, flags);
+}
+
+/* rmw task - runs one stage of a batch on imrsim_rmw_wq */
+/*rmw 任务 */
+static void read_modify_write_task(struct work_struct *work)
+{
+    struct imrsim_rmw_batch *batch = container_of(to_delayed_work(work), struct imrsim_rmw_batch, dwork);
+    struct imrsim_c *c = batch->ti->private;
+    blk_opf_t fua = c->rmw_durability == IMR_RMW_DURABLE_FUA ? REQ_FUA : 0;
+    struct imrsim_rmw_batch *next;
+    struct imrsim_top_write *top;
+    struct imrsim_per_bio *pb;
+    struct bio_list issue;
+    struct bio *clone;
+    struct bio *bio;
+    struct imrsim_rmw_task *rmw, *tmp;
+    __u32 nr_writes;
+    __u8 k;
+
+    switch(batch->stage)
+    {
+        case IMR_RMW_COLLECT:
+            // the window is over, later writes of the track group open a new batch and
+            // the top-track writes of its blocks wait, those in flight are waited for
+            spin_lock_irq(&c->batcher.lock);
+            batch->stage = IMR_RMW_BACKUP;
+            list_for_each_entry(top, &c->batcher.writes, list){
+                if(imrsim_rmw_overlaps(batch, top)){
+                    batch->nr_writes++;
+                }
+            }
+            nr_writes = batch->nr_writes;
+            spin_unlock_irq(&c->batcher.lock);
+            if(nr_writes){
+                break;   // requeued by the last of them
+            }
+            /* fall through */
+        case IMR_RMW_BACKUP:
+            // The batches holding the pages need this workqueue to write them back, a batch
+            // short of pages tries again later rather than waiting for them here.
+            if(!imrsim_rmw_alloc_pages(c, batch)){
+                queue_delayed_work(c->rmw_wq, &batch->dwork, 1);
+                break;
+            }
+            trace_imrsim_rmw_start(imrsim_rmw_sector(batch, 0, 0),
+                                   bitmap_weight(batch->top[0], TOP_TRACK_SIZE) +
+                                   bitmap_weight(batch->top[1], TOP_TRACK_SIZE));
+            // read the blocks needed to back up, all the runs at once  读取需要备份块
+            atomic_set(&batch->pending, 1);
+            for(k = 0; k < 2 && !batch->error; k++){
+                imrsim_rmw_submit(batch, k, REQ_OP_READ | REQ_SYNC);
+            }
+            imrsim_rmw_put(batch);
+            break;
+        case IMR_RMW_WRITE:
+            // write the bottom-track bios through clones, the bios are completed after the write back  写当前bio
+            atomic_set(&batch->pending, 1);
+            list_for_each_entry(rmw, &batch->bios, list){
+                // submitted at once, the clone goes back to the pool before the next one waits for it
+                clone = bio_alloc_clone(c->dev->bdev, rmw->bio, GFP_NOIO, &c->rmw_bio_set);
+                clone->bi_opf |= fua;
+                clone->bi_end_io = imrsim_end_rmw;
+                clone->bi_private = batch;
+                atomic_inc(&batch->pending);
+                dm_submit_bio_remap(rmw->bio, clone);
+            }
+            imrsim_rmw_put(batch);
+            break;
+        case IMR_RMW_WRITEBACK:
+            // write back  回写。
+            //如果修改rmw策略为mom，则写回位置应该通过计算寻找一个较为cold磁道中的位置。
+            atomic_set(&batch->pending, 1);
+            for(k = 0; k < 2 && !batch->error; k++){
+                imrsim_rmw_submit(batch, k, REQ_OP_WRITE | fua);
+            }
+            imrsim_rmw_put(batch);
+            break;
+        case IMR_RMW_FLUSH:
+            // one flush makes the whole RMW durable
+            if(c->rmw_durability == IMR_RMW_DURABLE_FLUSH){
+                atomic_set(&batch->pending, 1);
+                imrsim_rmw_flush(batch);
+                imrsim_rmw_put(batch);
+                break;
+            }
+            batch->stage = IMR_RMW_DONE;
+            /* fall through */
+        case IMR_RMW_DONE:
+            // release the pages the completions have not given back  释放页
+            imrsim_rmw_free_pages(c, batch);
+            trace_imrsim_rmw_end(imrsim_rmw_sector(batch, 0, 0), blk_status_to_errno(batch->error));
+            // let the batch waiting for this one start
+            bio_list_init(&issue);
+            spin_lock_irq(&c->batcher.lock);
+            list_del(&batch->list);
+            next = imrsim_rmw_find(c, batch->zone_idx, batch->trackno, 1);
+            if(next && next->deferred){
+                next->deferred = 0;
+                queue_delayed_work(c->rmw_wq, &next->dwork,
+                                   next->nr_bios >= IMR_RMW_BATCH_MAX ? 0 : msecs_to_jiffies(IMR_RMW_BATCH_WINDOW));
+            }
+            // the top-track writes it held go out, unless a batch of the next track group holds them
+            while((bio = bio_list_pop(&batch->waiters))){
+                pb = dm_per_bio_data(bio, sizeof(struct imrsim_per_bio));
+                if(!imrsim_top_write_start(c, &pb->top, bio)){
+                    bio_list_add(&issue, bio);
+                }
+            }
+            spin_unlock_irq(&c->batcher.lock);
+            while((bio = bio_list_pop(&issue))){
+                dm_submit_bio_remap(bio, NULL);
+            }
+            // rmw lives in the per-bio data, do not touch it after bio_endio
+            list_for_each_entry_safe(rmw, tmp, &batch->bios, list){
+                rmw->bio->bi_status = batch->error;
+                bio_endio(rmw->bio);
+            }
+            mempool_free(batch, c->batch_pool);
+            break;
+    }
+}
+
+/* RMW event caused by update to bottom track, the bio joins the batch of its track group  底部磁道更新引起的RMW事件*/
+static void imrsim_rmw_queue(struct dm_target *ti, __u32 zone_idx,
+                             struct imrsim_rmw_task *rmw, struct bio *bio)
+{
+    struct imrsim_c *c = ti->private;
+    struct imrsim_rmw_batch *batch;
+    struct imrsim_rmw_batch *new;
+
+    new = mempool_alloc(c->batch_pool, GFP_NOIO);
+    memset(new, 0, sizeof(*new));
+    rmw->bio = bio;
+    spin_lock_irq(&c->batcher.lock);
+    batch = imrsim_rmw_find(c, zone_idx, rmw->trackno, 1);
+    if(!batch){
+        batch = new;
+        new = NULL;
+        INIT_DELAYED_WORK(&batch->dwork, read_modify_write_task);
+        INIT_LIST_HEAD(&batch->bios);
+        bio_list_init(&batch->waiters);
+        batch->ti = ti;
+        batch->zone_idx = zone_idx;
+        batch->trackno = rmw->trackno;
+        batch->stage = IMR_RMW_COLLECT;
+        // A running batch of the track group has to write its blocks back first.
+        batch->deferred = imrsim_rmw_find(c, zone_idx, rmw->trackno, 0) != NULL;
+        list_add_tail(&batch->list, &c->batcher.batches);
+        if(!batch->deferred){
+            queue_delayed_work(c->rmw_wq, &batch->dwork, msecs_to_jiffies(IMR_RMW_BATCH_WINDOW));
+        }
+    }
+    rmw->batch = batch;
+    list_add_tail(&rmw->list, &batch->bios);
+    bitmap_or(batch->top[0], batch->top[0], rmw->top[0], TOP_TRACK_SIZE);
+    bitmap_or(batch->top[1], batch->top[1], rmw->top[1], TOP_TRACK_SIZE);
+    if(++batch->nr_bios == IMR_RMW_BATCH_MAX && !batch->deferred &&
+       cancel_delayed_work(&batch->dwork)){   // still in its window
+        queue_delayed_work(c->rmw_wq, &batch->dwork, 0);
+    }
+    spin_unlock_irq(&c->batcher.lock);
+    if(new){
+        mempool_free(new, c->batch_pool);
+    }
+}
+
+/* To resubmit the bios whose delay expired, in process context. */
+static void imrsim_delay_work(struct work_struct *work)
+{
+    struct imrsim_c *c = container_of(work, struct imrsim_c, delayed.work);
+    struct bio_list bios;
+    struct bio *bio;
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->delayed.lock, flags);
+    bios = c->delayed.bios;
+    bio_list_init(&c->delayed.bios);
+    spin_unlock_irqrestore(&c->delayed.lock, flags);
+    while((bio = bio_list_pop(&bios))){
+        dm_submit_bio_remap(bio, NULL);
+    }
+}
+
+/* Delay timer, runs in hard irq context and hands the bio over to the workqueue. */
+static enum hrtimer_restart imrsim_delay_expired(struct hrtimer *timer)
+{
+    struct imrsim_delay_task *delay = container_of(timer, struct imrsim_delay_task, timer);
+    struct imrsim_c *c = delay->c;
+    unsigned long flags;
+
+    if(delay->end){
+        delay->bio->bi_status = delay->error;
+        bio_endio(delay->bio);
+        return HRTIMER_NORESTART;
+    }
+    spin_lock_irqsave(&c->delayed.lock, flags);
+    bio_list_add(&c->delayed.bios, delay->bio);
+    spin_unlock_irqrestore(&c->delayed.lock, flags);
+    queue_work(c->rmw_wq, &c->delayed.work);
+    return HRTIMER_NORESTART;
+}
+
+static void imrsim_delay_start(struct imrsim_delay_task *delay, unsigned int penalty)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+    hrtimer_init(&delay->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    delay->timer.function = imrsim_delay_expired;
+#else
+    hrtimer_setup(&delay->timer, imrsim_delay_expired, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+    hrtimer_start(&delay->timer, ns_to_ktime((u64)penalty * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+}
+
+/* To hold a remapped bio for penalty usec instead of spinning in map. */
+static void imrsim_delay_queue(struct imrsim_delay_task *delay, struct bio *bio,
+                               unsigned int penalty)
+{
+    delay->bio = bio;
+    delay->end = 0;
+    imrsim_delay_start(delay, penalty);
+}
+
+/* To complete a bio penalty usec later, for the bios not sent as a whole. */
+static void imrsim_delay_end(struct imrsim_delay_task *delay, struct bio *bio,
+                             blk_status_t error, unsigned int penalty)
+{
+    delay->bio = bio;
+    delay->error = error;
+    delay->end = 1;
+    imrsim_delay_start(delay, penalty);
+}
+
+/* To drop a reference on a split read, the last one completes it. */
+static void imrsim_read_put(struct imrsim_read_task *rd)
+{
+    struct imrsim_per_bio *pb;
+
+    if(!atomic_dec_and_test(&rd->pending)){
+        return;
+    }
+    if(rd->penalty){
+        pb = container_of(rd, struct imrsim_per_bio, read);
+        imrsim_delay_end(&pb->delay, rd->bio, rd->error, rd->penalty);
+        return;
+    }
+    rd->bio->bi_status = rd->error;
+    bio_endio(rd->bio);
+}
+
+/* End event for the clones of a split read */
+static void imrsim_end_read_clone(struct bio *clone)
+{
+    struct imrsim_read_task *rd = clone->bi_private;
+
+    if(clone->bi_status){
+        printk(KERN_ERR "imrsim: read clone err: %d\n", blk_status_to_errno(clone->bi_status));
+        rd->error = clone->bi_status;
+    }
+    bio_put(clone);
+    imrsim_read_put(rd);
+}
+
+/* To issue the clones of a split read, called without the zone lock. */
+static void imrsim_read_submit(struct dm_target *ti, struct imrsim_read_task *rd,
+                               struct bio_list *clones, unsigned int penalty)
+{
+    struct bio *clone;
+
+    rd->penalty = penalty;
+    while((clone = bio_list_pop(clones))){
+        clone->bi_iter.bi_sector = imrsim_map_sector(ti, clone->bi_iter.bi_sector);
+        dm_submit_bio_remap(rd->bio, clone);
+    }
+    imrsim_read_put(rd);
+}
+
+/*
+ * To persist the copy of the mapping table of a zone a checkpoint took, the slot holds the
+ * table as in block mode. Block mode writes the slots through the cache.
+ */
+static int imrsim_save_zone_map(struct imrsim_c *c, __u32 zone_idx, struct imrsim_zone_extents *ze,
+                                struct imrsim_md_io *io)
+{
+    struct imrsim_zone_map *map = c->map_buf;
+
+    memset(map, 0, sizeof(*map));
+    imrsim_extents_to_map(rcu_dereference_protected(ze->fwd, true), map->mapped, map->pba);
+    imrsim_extents_to_map(rcu_dereference_protected(ze->rev, true), map->used, map->lba);
+    // the buffer is filled again for the next zone once the writes of this one are done
+    imrsim_md_write(c, io, imrsim_map_slot(c, zone_idx), map, DIV_ROUND_UP(sizeof(*map), PAGE_SIZE));
+    return imrsim_md_wait(c, io, 0);
+}
+
+/* To copy the mapping table of a zone for a checkpoint, no write changes it meanwhile. */
+static struct imrsim_zone_extents *imrsim_zone_extents_copy(struct imrsim_zone_extents *ze)
+{
+    struct imrsim_extent_array *fwd = rcu_dereference_protected(ze->fwd, true);
+    struct imrsim_extent_array *rev = rcu_dereference_protected(ze->rev, true);
+    struct imrsim_zone_extents *cp = imrsim_zone_extents_alloc(fwd->nr, rev->nr, GFP_NOIO);
+    struct imrsim_extent_array *arr;
+
+    if(cp){
+        arr = rcu_dereference_protected(cp->fwd, true);
+        memcpy(arr->ext, fwd->ext, fwd->nr * sizeof(fwd->ext[0]));
+        arr->nr = fwd->nr;
+        arr = rcu_dereference_protected(cp->rev, true);
+        memcpy(arr->ext, rev->ext, rev->nr * sizeof(rev->ext[0]));
+        arr->nr = rev->nr;
+    }
+    return cp;
+}
+
+/* To check the forward and the reverse maps of a zone agree. */
+static int imrsim_zone_map_check(struct imrsim_zone_map *map)
+{
+    __u32 block;
+
+    if(bitmap_weight(map->mapped, TOTAL_ITEMS) != bitmap_weight(map->used, TOTAL_ITEMS)){
+        return -EINVAL;
+    }
+    for_each_set_bit(block, map->mapped, TOTAL_ITEMS){
+        if(!test_bit(map->pba[block], map->used) || map->lba[map->pba[block]] != block){
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * To drop the entries of a slot whose forward and reverse maps disagree. A slot is written
+ * in place, by dm-bufio in any order or by a checkpoint before its header commits, a crash
+ * leaves the mapped bit and the pba of an update on different pages. Such an update is in
+ * no checkpoint, the journal maps it again. Returns the entries dropped.
+ */
+static __u32 imrsim_zone_map_repair(struct imrsim_zone_map *map)
+{
+    __u32 dropped = 0;
+    __u32 idx;
+
+    for_each_set_bit(idx, map->mapped, TOTAL_ITEMS){
+        if(!test_bit(map->pba[idx], map->used) || map->lba[map->pba[idx]] != idx){
+            __clear_bit(idx, map->mapped);
+            dropped++;
+        }
+    }
+    for_each_set_bit(idx, map->used, TOTAL_ITEMS){
+        if(!test_bit(map->lba[idx], map->mapped) || map->pba[map->lba[idx]] != idx){
+            __clear_bit(idx, map->used);
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+static unsigned long *imrsim_top_used(struct imrsim_c *c, __u32 zone_idx, __u32 trackno);
+static __u32 imrsim_pba_alloc_index(__u32 pba);
+static void imrsim_pstore_mark(struct imrsim_c *c, unsigned char change);
+
+/*
+ * A slot is written before the copy of the state that commits it, it may hold more blocks
+ * than the state allocated. The allocation only depends on z_map_size, the zone takes them:
+ * z_map_size goes past the last PBA used in the allocation order, a repaired slot may have
+ * holes before it.
+ */
+static void imrsim_zone_map_adopt(struct imrsim_c *c, __u32 zone_idx, struct imrsim_zone_map *map)
+{
+    struct imrsim_zone_status *zs = &c->zone_status[zone_idx];
+    __u32 map_size = 0;
+    unsigned long *top;
+    __u32 pba;
+
+    for_each_set_bit(pba, map->used, TOTAL_ITEMS){
+        if(pba / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) < TOP_TRACK_NUM_TOTAL){
+            map_size = max(map_size, imrsim_pba_alloc_index(pba) + 1);
+        }
+    }
+    if(map_size <= zs->z_map_size){
+        return;
+    }
+    for_each_set_bit(pba, map->used, TOTAL_ITEMS){
+        if(pba % (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) >= IMR_TOP_TRACK_SIZE ||
+           pba / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) >= TOP_TRACK_NUM_TOTAL){
+            continue;
+        }
+        top = imrsim_top_used(c, zone_idx, pba / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE));
+        __set_bit(pba % (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE), top);
+        imrsim_state_dirty(c, top, sizeof(struct imrsim_zone_track));
+    }
+    zs->z_map_size = map_size;
+    imrsim_state_dirty(c, zs, sizeof(*zs));
+    imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
+}
+
+/*
+ * To read the mapping table of a zone from its slot and check it, the caller holds the
+ * zone lock. It may run in the I/O path, its slot is read in one go. The slot may have
+ * been written past the copy of the state loaded or torn by a crash in both modes, it is
+ * repaired before the zone adopts it.
+ */
+static int imrsim_load_zone_map(struct imrsim_c *c, __u32 zone_idx)
+{
+    struct imrsim_zone_extents *ze;
+    struct imrsim_zone_map *map;
+    struct imrsim_md_io io;
+    __u32 nr;
+    int ret;
+
+    map = kvmalloc(round_up(sizeof(*map), PAGE_SIZE), GFP_NOIO);
+    if(!map){
+        return -ENOMEM;
+    }
+    imrsim_md_init(&io);
+    imrsim_md_read(c, &io, imrsim_map_slot(c, zone_idx), map, DIV_ROUND_UP(sizeof(*map), PAGE_SIZE));
+    ret = imrsim_md_wait(c, &io, 0);
+    if(ret < 0){
+        goto out;
+    }
+    nr = imrsim_zone_map_repair(map);
+    if(nr){
+        printk(KERN_ERR "imrsim: %u torn entries dropped from the mapping table of zone %u\n", nr, zone_idx);
+        imrsim_md_write(c, &io, imrsim_map_slot(c, zone_idx), map, DIV_ROUND_UP(sizeof(*map), PAGE_SIZE));
+        ret = imrsim_md_wait(c, &io, 1);
+        if(c->bufio){
+            dm_bufio_forget_buffers(c->bufio, imrsim_map_slot(c, zone_idx) >> (PAGE_SHIFT - SECTOR_SHIFT),
+                                    DIV_ROUND_UP(sizeof(*map), PAGE_SIZE));
+        }
+        if(ret < 0){
+            goto out;
+        }
+    }
+    if(imrsim_zone_map_check(map)){
+        printk(KERN_ERR "imrsim: mapping table of zone %u is inconsistent\n", zone_idx);
+        ret = -EINVAL;
+        goto out;
+    }
+    if(c->bufio){
+        imrsim_zone_map_adopt(c, zone_idx, map);
+        goto out;
+    }
+    ze = kzalloc(sizeof(*ze), GFP_NOIO);
+    if(ze){
+        RCU_INIT_POINTER(ze->fwd, imrsim_extents_from_map(map->mapped, map->pba));
+        RCU_INIT_POINTER(ze->rev, imrsim_extents_from_map(map->used, map->lba));
+    }
+    if(!ze || !rcu_access_pointer(ze->fwd) || !rcu_access_pointer(ze->rev)){
+        printk(KERN_ERR "imrsim: memory alloc failed for the extents of zone %u\n", zone_idx);
+        imrsim_zone_extents_free(ze);
+        ret = -ENOMEM;
+        goto out;
+    }
+    imrsim_zone_map_adopt(c, zone_idx, map);
+    smp_store_release(&c->zone_extents[zone_idx], ze);
+out:
+    kvfree(map);
+    return ret;
+}
+
+/* To bring in the mapping table of a zone the load left in its slot, the caller holds the zone lock. */
+static int __imrsim_zone_map_fault(struct imrsim_c *c, __u32 zone_idx)
+{
+    int ret;
+
+    if(!c->maps_lazy || !test_bit(zone_idx, c->maps_lazy)){
+        return 0;
+    }
+    ret = imrsim_load_zone_map(c, zone_idx);
+    if(!ret){
+        clear_bit_unlock(zone_idx, c->maps_lazy);   // after the table is published
+    }
+    return ret;
+}
+
+/* To bring in the mapping table of a zone on its first access since the load. */
+static int imrsim_zone_map_fault(struct imrsim_c *c, __u32 zone_idx)
+{
+    int ret;
+
+    if(!c->maps_lazy || !test_bit_acquire(zone_idx, c->maps_lazy)){
+        return 0;
+    }
+    mutex_lock(imrsim_zone_lock(c, zone_idx));
+    ret = __imrsim_zone_map_fault(c, zone_idx);
+    mutex_unlock(imrsim_zone_lock(c, zone_idx));
+    return ret;
+}
+
+int imrsim_map(struct dm_target *ti, struct bio *bio);
+
+/* To hand a bio over to the workqueue, that reads the mapping table of its zone and maps it again. */
+static void imrsim_fault_queue(struct imrsim_c *c, struct bio *bio)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->faults.lock, flags);
+    bio_list_add(&c->faults.bios, bio);
+    spin_unlock_irqrestore(&c->faults.lock, flags);
+    queue_work(c->rmw_wq, &c->faults.work);
+}
+
+/* To read the mapping tables the deferred bios wait for and map them again, in process context. */
+static void imrsim_fault_work(struct work_struct *work)
+{
+    struct imrsim_c *c = container_of(work, struct imrsim_c, faults.work);
+    struct bio_list bios;
+    struct bio *bio;
+    __u32 zone_idx;
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&c->faults.lock, flags);
+    bios = c->faults.bios;
+    bio_list_init(&c->faults.bios);
+    spin_unlock_irqrestore(&c->faults.lock, flags);
+    while((bio = bio_list_pop(&bios))){
+        zone_idx = bio->bi_iter.bi_sector >> c->block_size_shift >> c->zone_size_shift;
+        down_read(&c->state_lock);
+        ret = zone_idx < c->nr_zones ? imrsim_zone_map_fault(c, zone_idx) : 0;
+        up_read(&c->state_lock);
+        if(ret){
+            printk(KERN_ERR "imrsim: error: cannot load the mapping table of zone %u\n", zone_idx);
+            imrsim_pstore_mark(c, IMR_STATS_CHANGE);
+            bio_io_error(bio);
+            continue;
+        }
+        switch(imrsim_map(c->ti, bio)){
+        case DM_MAPIO_REMAPPED:
+            dm_submit_bio_remap(bio, NULL);
+            break;
+        case DM_MAPIO_KILL:
+            bio_io_error(bio);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static int imrsim_lookup(struct imrsim_c *c, __u32 zone_idx, __u32 index, int rev);
+static int imrsim_map_block(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset, __u32 pba);
+
+/* To get the first sector of the journal, after the slots of the mapping tables. */
+static sector_t imrsim_journal_lba(struct imrsim_c *c)
+{
+    return imrsim_map_slot(c, c->nr_maps);
+}
+
+static struct imrsim_journal_page *imrsim_journal_page(struct imrsim_c *c, __u32 idx)
+{
+    return (struct imrsim_journal_page *)(c->journal.pages + (size_t)idx * PAGE_SIZE);
+}
+
+/* To get the n-th record of the journal, the pages before the last one are full. */
+static struct imrsim_journal_rec *imrsim_journal_rec(struct imrsim_c *c, __u32 n)
+{
+    return &imrsim_journal_page(c, n / IMR_JOURNAL_RECS)->rec[n % IMR_JOURNAL_RECS];
+}
+
+/* To empty the journal, once a checkpoint holds its records. */
+static void imrsim_journal_reset(struct imrsim_c *c)
+{
+    __u32 idx;
+
+    spin_lock(&c->journal.lock);
+    for(idx = 0; idx < IMR_JOURNAL_PAGES; idx++){
+        imrsim_journal_page(c, idx)->nr = 0;
+    }
+    c->journal.head = 0;
+    c->journal.synced = 0;
+    c->journal.pending = 0;
+    c->journal.mark = 0;
+    c->journal.dirty = 0;
+    c->journal.overflow = 0;
+    c->journal.checkpoint = jiffies;
+    spin_unlock(&c->journal.lock);
+}
+
+/* To count the records of the journal, the caller holds the journal lock. */
+static __u32 imrsim_journal_count(struct imrsim_c *c)
+{
+    __u32 nr = c->journal.head * IMR_JOURNAL_RECS;
+
+    if(c->journal.head < IMR_JOURNAL_PAGES){
+        nr += imrsim_journal_page(c, c->journal.head)->nr;
+    }
+    return nr;
+}
+
+/*
+ * To mark the records a checkpoint takes, under the exclusive state lock. They stay in the
+ * journal until the checkpoint is on the disk, the records logged meanwhile follow them.
+ */
+static void imrsim_journal_mark(struct imrsim_c *c)
+{
+    spin_lock(&c->journal.lock);
+    c->journal.mark = imrsim_journal_count(c);
+    c->journal.mark_overflow = c->journal.overflow;
+    c->journal.overflow = 0;
+    spin_unlock(&c->journal.lock);
+}
+
+/*
+ * To drop the records of a checkpoint once it is on the disk. The records logged while it
+ * was written move to the front, they are written again under its seq.
+ */
+static void imrsim_journal_trim(struct imrsim_c *c)
+{
+    __u32 nr;
+    __u32 n;
+    __u32 idx;
+
+    spin_lock(&c->journal.lock);
+    nr = imrsim_journal_count(c) - c->journal.mark;
+    for(n = 0; n < nr; n++){
+        *imrsim_journal_rec(c, n) = *imrsim_journal_rec(c, c->journal.mark + n);
+    }
+    for(idx = 0; idx < IMR_JOURNAL_PAGES; idx++){
+        imrsim_journal_page(c, idx)->nr = idx < nr / IMR_JOURNAL_RECS ? IMR_JOURNAL_RECS :
+                                          idx == nr / IMR_JOURNAL_RECS ? nr % IMR_JOURNAL_RECS : 0;
+    }
+    c->journal.head = nr / IMR_JOURNAL_RECS;
+    c->journal.synced = 0;
+    c->journal.pending = nr;
+    c->journal.dirty = nr != 0;
+    c->journal.since = jiffies;
+    c->journal.mark = 0;
+    c->journal.checkpoint = jiffies;
+    spin_unlock(&c->journal.lock);
+}
+
+/* To keep the records of a checkpoint which failed, the journal goes on under the last seq. */
+static void imrsim_journal_unmark(struct imrsim_c *c)
+{
+    spin_lock(&c->journal.lock);
+    c->journal.overflow |= c->journal.mark_overflow;
+    c->journal.mark = 0;
+    spin_unlock(&c->journal.lock);
+}
+
+/*
+ * To log the PBA just allocated to a block of a zone, the caller holds the zone lock. The
+ * first record arms the deadline of the persistence thread, min_batch records wake it.
+ */
+static void imrsim_journal_add(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset, __u32 pba)
+{
+    struct imrsim_journal_page *jp;
+    struct imrsim_journal_rec *rec;
+    bool wake;
+
+    spin_lock(&c->journal.lock);
+    wake = ++c->journal.pending == c->ptask.min_batch;
+    if(c->journal.head == IMR_JOURNAL_PAGES){
+        c->journal.overflow = 1;
+    }else{
+        jp = imrsim_journal_page(c, c->journal.head);
+        rec = &jp->rec[jp->nr];
+        rec->zone_idx = zone_idx;
+        rec->block = block_offset;
+        rec->pba = pba;
+        rec->map_size = c->zone_status[zone_idx].z_map_size;
+        if(++jp->nr == IMR_JOURNAL_RECS){
+            c->journal.head++;
+        }
+        if(!c->journal.dirty){
+            c->journal.since = jiffies;
+            c->journal.dirty = 1;
+            wake = true;
+        }
+    }
+    spin_unlock(&c->journal.lock);
+    if(wake){
+        wake_up(&c->ptask.wait);
+    }
+}
+
+/* To tell whether a checkpoint is due: the journal fills up or the last checkpoint is old. */
+static bool imrsim_journal_due(struct imrsim_c *c)
+{
+    return c->journal.overflow || c->journal.head >= IMR_JOURNAL_PAGES * 3 / 4 ||
+           time_after_eq(jiffies, c->journal.checkpoint + msecs_to_jiffies(IMR_JOURNAL_CHECKPOINT));
+}
+
+static __u32 imrsim_journal_crc(struct imrsim_journal_page *jp)
+{
+    return crc32(0, (unsigned char *)jp + offsetof(struct imrsim_journal_page, seq),
+                 PAGE_SIZE - offsetof(struct imrsim_journal_page, seq));
+}
+
+static void imrsim_journal_stamp(struct imrsim_c *c, struct imrsim_journal_page *jp, __u32 idx)
+{
+    jp->magic = IMR_JOURNAL_MAGIC;
+    jp->seq = c->zone_state->header.seq;
+    jp->index = idx;
+    jp->crc32 = imrsim_journal_crc(jp);
+}
+
+/*
+ * To write the journal pages whose records are not on the disk yet. The full pages do not
+ * change any more, the one still filling is copied under the journal lock so that the
+ * mapping updates go on while it is written. The state lock is held shared.
+ */
+static int imrsim_journal_sync(struct imrsim_c *c)
+{
+    struct imrsim_journal_page *copy = imrsim_journal_page(c, IMR_JOURNAL_PAGES);
+    struct imrsim_md_io io;
+    __u32 synced;
+    __u32 head;
+    __u32 idx;
+    int ret;
+
+    spin_lock(&c->journal.lock);
+    if(!c->journal.dirty){
+        spin_unlock(&c->journal.lock);
+        return 0;
+    }
+    synced = c->journal.synced;
+    head = c->journal.head;
+    copy->nr = 0;
+    if(head < IMR_JOURNAL_PAGES){
+        memcpy(copy, imrsim_journal_page(c, head), PAGE_SIZE);
+    }
+    c->journal.pending = 0;
+    c->journal.dirty = 0;
+    spin_unlock(&c->journal.lock);
+
+    for(idx = synced; idx < head; idx++){
+        imrsim_journal_stamp(c, imrsim_journal_page(c, idx), idx);
+    }
+    // the pages go out in one run and a single flush makes them durable
+    imrsim_md_init(&io);
+    imrsim_md_write(c, &io, imrsim_journal_lba(c) + ((sector_t)synced << IMR_PAGE_SIZE_SHIFT_DEFAULT),
+                    imrsim_journal_page(c, synced), head - synced);
+    if(copy->nr){
+        imrsim_journal_stamp(c, copy, head);
+        imrsim_md_write(c, &io, imrsim_journal_lba(c) + ((sector_t)head << IMR_PAGE_SIZE_SHIFT_DEFAULT),
+                        copy, 1);
+    }
+    ret = imrsim_md_wait(c, &io, 1);
+    if(ret < 0){
+        // written again with the next records
+        spin_lock(&c->journal.lock);
+        c->journal.since = jiffies;
+        c->journal.dirty = 1;
+        spin_unlock(&c->journal.lock);
+        return ret;
+    }
+    c->journal.synced = head;   // only this thread moves it
+    return 0;
+}
+
+/* To read the whole journal area into its image without waiting, the state is checked meanwhile. */
+static void imrsim_journal_read(struct imrsim_c *c, struct imrsim_md_io *io)
+{
+    imrsim_md_read(c, io, imrsim_journal_lba(c), c->journal.pages, IMR_JOURNAL_PAGES);
+}
+
+/*
+ * To find the journal of the checkpoint the state was loaded from in the image read, it
+ * ends at the first page which is partly filled or not written since that checkpoint.
+ * Returns its records.
+ */
+static __u32 imrsim_journal_scan(struct imrsim_c *c)
+{
+    struct imrsim_journal_page *jp;
+    __u32 nr = 0;
+    __u32 idx;
+
+    for(idx = 0; idx < IMR_JOURNAL_PAGES; idx++){
+        jp = imrsim_journal_page(c, idx);
+        if(jp->magic != IMR_JOURNAL_MAGIC || jp->seq != c->zone_state->header.seq ||
+           jp->index != idx || !jp->nr || jp->nr > IMR_JOURNAL_RECS || jp->crc32 != imrsim_journal_crc(jp)){
+            break;
+        }
+        nr += jp->nr;
+        if(jp->nr < IMR_JOURNAL_RECS){
+            break;
+        }
+    }
+    return nr;
+}
+
+/*
+ * To apply a record of the journal to the loaded state. The mappings the tables already
+ * have are left alone, so that a record applies any number of times. Returns -EINVAL for
+ * a damaged record and -EIO if the zone cannot take it.
+ */
+static int imrsim_journal_apply(struct imrsim_c *c, struct imrsim_journal_rec *rec)
+{
+    __u32 trackno = rec->pba / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);
+    __u32 blockno = rec->pba % (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);
+    struct imrsim_zone_status *zs;
+    int ret;
+
+    if(rec->zone_idx >= c->nr_zones || trackno >= TOP_TRACK_NUM_TOTAL || !rec->map_size){
+        printk(KERN_ERR "imrsim: bad journal record: zone %u block %u pba %u\n",
+               rec->zone_idx, rec->block, rec->pba);
+        return -EINVAL;
+    }
+    zs = &c->zone_status[rec->zone_idx];
+    mutex_lock(imrsim_zone_lock(c, rec->zone_idx));
+    ret = __imrsim_zone_map_fault(c, rec->zone_idx);
+    if(!ret){
+        ret = imrsim_zone_map_alloc(c, rec->zone_idx);
+    }
+    if(!ret && imrsim_lookup(c, rec->zone_idx, rec->block, 0) != rec->pba){
+        ret = imrsim_map_block(c, rec->zone_idx, rec->block, rec->pba);
+    }
+    if(!ret){
+        zs->z_map_size = max(zs->z_map_size, rec->map_size);
+        imrsim_state_dirty(c, zs, sizeof(*zs));
+        if(blockno < IMR_TOP_TRACK_SIZE){
+            __set_bit(blockno, imrsim_top_used(c, rec->zone_idx, trackno));
+            imrsim_state_dirty(c, imrsim_top_used(c, rec->zone_idx, trackno), sizeof(struct imrsim_zone_track));
+        }
+    }
+    mutex_unlock(imrsim_zone_lock(c, rec->zone_idx));
+    if(ret){
+        printk(KERN_ERR "imrsim: zone %u cannot replay its journal: %d\n", rec->zone_idx, ret);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * To record a change of the metadata for the persistence thread, the first one arms its
+ * deadline and a configuration change is checkpointed at once.
+ */
+static void imrsim_pstore_mark(struct imrsim_c *c, unsigned char change)
+{
+    bool wake;
+
+    if((READ_ONCE(c->ptask.flag) & change) == change){
+        return;   // most of the I/O finds it set already
+    }
+    spin_lock(&c->ptask.lock);
+    wake = !c->ptask.flag || (change & IMR_CONFIG_CHANGE);
+    c->ptask.flag |= change;
+    spin_unlock(&c->ptask.lock);
+    if(wake){
+        wake_up(&c->ptask.wait);
+    }
+}
+
+/*
+ * To flush the metadata between two checkpoints: only the journal is written, the state
+ * on the disk stays the one of the last checkpoint so that its crc keeps matching. The
+ * mapping updates go on meanwhile.
+ */
+static int imrsim_flush_persistence(struct dm_target *ti)//元数据同步磁盘
+{
+    struct imrsim_c  *c;
+    int              ret;
+
+    c = ti->private;
+    down_read(&c->state_lock);   // the layout of the persistence area stays
+    ret = imrsim_journal_sync(c);
+    up_read(&c->state_lock);
+    if(ret < 0){
+        return ret;
+    }
+    if(c->dbg_log_enabled && printk_ratelimit()){
+        printk(KERN_ERR "imrsim: flush persist success\n");
+    }
+    return 0;
+}
+
+/* To get the page pos of the shadow, the pages of shadow_dirty follow each other in it. */
+static unsigned char *imrsim_shadow_page(struct imrsim_c *c, __u32 pos)
+{
+    return (unsigned char *)c->shadow + (size_t)pos * PAGE_SIZE;
+}
+
+/*
+ * To take what a checkpoint writes, under the exclusive state lock: the pages of the state
+ * its copy lacks go to the shadow, sized for them, the changed mapping tables are copied
+ * and the records of the journal it holds are marked. The shadow carries the next seq.
+ */
+static int imrsim_checkpoint_snap(struct imrsim_c *c)
+{
+    struct imrsim_zone_extents *ze;
+    __u32            nr_pages;
+    __u32            pos;
+    __u32            idx;
+    __u32            end;
+
+    nr_pages = DIV_ROUND_UP(c->zone_state->header.length, PAGE_SIZE);
+    set_bit(0, c->state_dirty);
+    // the copy written was last written two checkpoints ago
+    bitmap_or(c->shadow_dirty, c->state_dirty, c->prev_dirty, nr_pages);
+    c->shadow = kvmalloc((size_t)bitmap_weight(c->shadow_dirty, nr_pages) * PAGE_SIZE, GFP_NOIO);
+    if(!c->shadow){
+        return -ENOMEM;
+    }
+    if(c->maps_dirty){
+        for_each_set_bit(idx, c->maps_dirty, c->nr_maps){
+            ze = c->zone_extents[idx];
+            if(!ze){
+                continue;
+            }
+            c->maps_shadow[idx] = imrsim_zone_extents_copy(ze);
+            if(!c->maps_shadow[idx]){
+                for(end = 0; end < idx; end++){
+                    imrsim_zone_extents_free(c->maps_shadow[end]);
+                    c->maps_shadow[end] = NULL;
+                }
+                kvfree(c->shadow);
+                c->shadow = NULL;
+                return -ENOMEM;
+            }
+        }
+        bitmap_zero(c->maps_dirty, c->nr_maps);
+    }
+    c->zone_state->header.seq++;
+    pos = 0;
+    for_each_set_bitrange(idx, end, c->shadow_dirty, nr_pages){
+        memcpy(imrsim_shadow_page(c, pos),
+               (unsigned char *)c->zone_state + (size_t)idx * PAGE_SIZE, (size_t)(end - idx) * PAGE_SIZE);
+        pos += end - idx;
+    }
+    bitmap_copy(c->prev_dirty, c->state_dirty, nr_pages);
+    bitmap_zero(c->state_dirty, nr_pages);
+    imrsim_journal_mark(c);
+    return 0;
+}
+
+/*
+ * To write what imrsim_checkpoint_snap took, under the shared state lock, to the copy of the
+ * state the last checkpoint left alone: the pages of the shadow in runs with the pages of the
+ * crc table their crcs changed, the copies of the mapping tables and the cached pages of the
+ * slots. Only the crcs of the pages written are computed, the header holds the crc of the
+ * table. The writes are plain ones made durable by a single flush, then the header page
+ * commits the copy with FUA. A crash before leaves the other copy the newest. Whatever is
+ * not on the disk is dirty again on failure.
+ */
+/*持久化元数据*/
+static int imrsim_save_persistence(struct imrsim_c *c)
+{
+    struct imrsim_md_io io;
+    __u32            copy = !c->state_copy;
+    __u32            nr_pages;
+    __u32            pos;
+    __u32            first;
+    __u32            idx;
+    __u32            end;
+    int              ret = 0;
+    int              err;
+
+    imrsim_md_init(&io);
+    if(c->bufio){
+        dm_bufio_write_dirty_buffers_async(c->bufio);
+    }
+    nr_pages = DIV_ROUND_UP(c->zone_state->header.length, PAGE_SIZE);
+    pos = 0;
+    for_each_set_bit(idx, c->shadow_dirty, nr_pages){
+        c->state_crcs[idx] = imrsim_state_page_crc(imrsim_shadow_page(c, pos++), idx);
+    }
+    c->shadow->header.crc32 = crc32(0, (unsigned char *)c->state_crcs, nr_pages * sizeof(__u32));
+    pos = 0;
+    for_each_set_bitrange(idx, end, c->shadow_dirty, nr_pages){
+        first = max_t(__u32, idx, 1);   // page 0 goes last
+        if(first < end){
+            imrsim_md_write(c, &io, imrsim_state_lba(c, copy) + ((sector_t)first << IMR_PAGE_SIZE_SHIFT_DEFAULT),
+                            imrsim_shadow_page(c, pos + first - idx), end - first);
+        }
+        pos += end - idx;
+    }
+    for(idx = 0; idx < imrsim_state_crc_pages(c->zone_state->header.length); idx++){
+        if(find_next_bit(c->shadow_dirty, nr_pages, idx * IMR_CRCS_PER_PAGE) < (idx + 1) * IMR_CRCS_PER_PAGE){
+            imrsim_md_write(c, &io, imrsim_state_crc_lba(c, copy) + ((sector_t)idx << IMR_PAGE_SIZE_SHIFT_DEFAULT),
+                            (unsigned char *)c->state_crcs + (size_t)idx * PAGE_SIZE, 1);
+        }
+    }
+    for(idx = 0; c->maps_shadow && idx < c->nr_maps; idx++){
+        if(!c->maps_shadow[idx]){
+            continue;
+        }
+        if(ret >= 0){
+            ret = imrsim_save_zone_map(c, idx, c->maps_shadow[idx], &io);
+        }
+        if(ret < 0){
+            set_bit(idx, c->maps_dirty);
+        }
+        imrsim_zone_extents_free(c->maps_shadow[idx]);
+        c->maps_shadow[idx] = NULL;
+    }
+    if(c->bufio && ret >= 0){
+        ret = dm_bufio_write_dirty_buffers(c->bufio);
+    }
+    // the shadow pages are waited for in any case, they are freed once it returns
+    err = imrsim_md_wait(c, &io, ret >= 0);
+    if(ret >= 0){
+        ret = err;
+    }
+    if(ret >= 0){
+        imrsim_md_submit(c, &io, REQ_OP_WRITE | REQ_FUA, imrsim_state_lba(c, copy), c->shadow, 1);
+        ret = imrsim_md_wait(c, &io, 0);
+    }
+    if(ret < 0){
+        for_each_set_bit(idx, c->shadow_dirty, nr_pages){
+            set_bit(idx, c->state_dirty);
+        }
+        return ret;
+    }
+    c->state_copy = copy;
+    if(c->dbg_log_enabled && printk_ratelimit()){
+        printk(KERN_INFO "imrsim: save persist success\n");
+    }
+    return 0;
+}
+
+/*
+ * To checkpoint the metadata: the state and the changed mapping tables are written under a
+ * new seq, which voids the journal written so far once its header is on the disk. Until
+ * then the journal keeps the records of the last seq, a failure goes back to it. The
+ * exclusive state lock is only held to take them, the I/O goes on while they are written.
+ */
+static int imrsim_checkpoint(struct dm_target *ti)
+{
+    struct imrsim_c *c = ti->private;
+    int ret;
+
+    down_write(&c->state_lock);
+    spin_lock(&c->ptask.lock);
+    c->ptask.flag = IMR_NO_CHANGE;
+    spin_unlock(&c->ptask.lock);
+    if(!c->nr_zones){
+        up_write(&c->state_lock);
+        return 0;
+    }
+    // the copies of the state on the disk are sized for the default zones
+    ret = c->zone_state->header.length > imrsim_state_size(c->nr_zones_default) ? -ENOSPC :
+          imrsim_checkpoint_snap(c);
+    downgrade_write(&c->state_lock);
+    if(ret >= 0){
+        ret = imrsim_save_persistence(c);
+        kvfree(c->shadow);
+        c->shadow = NULL;
+        // only this thread stamps the journal with the seq
+        if(ret >= 0){
+            imrsim_journal_trim(c);
+        }else{
+            c->zone_state->header.seq--;
+            imrsim_journal_unmark(c);
+        }
+    }
+    up_read(&c->state_lock);
+    if(ret < 0){
+        // the dirty pages and the tables are taken again by the next checkpoint
+        printk(KERN_ERR "imrsim: checkpoint failed: %d\n", ret);
+        spin_lock(&c->ptask.lock);
+        c->ptask.flag |= IMR_CONFIG_CHANGE;
+        spin_unlock(&c->ptask.lock);
+    }
+    return ret;
+}
+
+/* To mark the zones whose stats, status or top tracks lie in page idx of the state. */
+static void imrsim_state_page_zones(struct imrsim_c *c, __u32 idx, __u32 nr_layout, unsigned long *zones)
+{
+    const unsigned char *state = (const unsigned char *)c->zone_state;
+    const size_t base[3] = {
+        (const unsigned char *)c->zone_state->stats.zone_stats - state,
+        (const unsigned char *)c->zone_status - state,
+        (const unsigned char *)c->zone_tracks - state,
+    };
+    const size_t size[3] = {
+        sizeof(struct imrsim_zone_stats),
+        sizeof(struct imrsim_zone_status),
+        sizeof(struct imrsim_zone_track) * TOP_TRACK_NUM_TOTAL,
+    };
+    size_t lo = (size_t)idx * PAGE_SIZE;
+    size_t hi = lo + PAGE_SIZE;
+    size_t first;
+    size_t last;
+    int k;
+
+    for(k = 0; k < 3; k++){
+        if(hi <= base[k] || lo >= base[k] + nr_layout * size[k]){
+            continue;
+        }
+        first = lo > base[k] ? (lo - base[k]) / size[k] : 0;
+        last = min_t(size_t, nr_layout, DIV_ROUND_UP(hi - base[k], size[k]));
+        bitmap_set(zones, first, last - first);
+    }
+}
+
+/* To give a zone whose part of the state is damaged its default state, its mappings are lost. */
+static void imrsim_reset_damaged_zone(struct imrsim_c *c, __u32 zone_idx)
+{
+    struct imrsim_zone_track *tracks = &c->zone_tracks[(size_t)zone_idx * TOP_TRACK_NUM_TOTAL];
+
+    memset(&c->zone_state->stats.zone_stats[zone_idx], 0, sizeof(struct imrsim_zone_stats));
+    imrsim_state_dirty(c, &c->zone_state->stats.zone_stats[zone_idx], sizeof(struct imrsim_zone_stats));
+    imrsim_init_zone_status(c, zone_idx);
+    imrsim_state_dirty(c, &c->zone_status[zone_idx], sizeof(struct imrsim_zone_status));
+    memset(tracks, 0, TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+    imrsim_state_dirty(c, tracks, TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+}
+
+/* To give a zone whose mapping table cannot be loaded its default state, the table is dropped. */
+static void imrsim_reset_failed_zone(struct imrsim_c *c, __u32 zone_idx)
+{
+    imrsim_reset_damaged_zone(c, zone_idx);
+    if(c->maps_lazy){
+        clear_bit(zone_idx, c->maps_lazy);
+    }
+    if(c->zone_extents && c->zone_extents[zone_idx]){
+        imrsim_zone_extents_free(c->zone_extents[zone_idx]);
+        c->zone_extents[zone_idx] = NULL;   // no I/O runs during the load
+    }
+}
+
+/* To check a header read from the disk, nr_layout gets the zones the state was laid out for. */
+static bool imrsim_state_header_valid(struct imrsim_c *c, const struct imrsim_state_header *header,
+                                      __u32 *nr_layout)
+{
+    // add_zone_config may have used fewer zones
+    *nr_layout = header->length > imrsim_state_size(0) ?
+                 (header->length - imrsim_state_size(0)) / IMR_STATE_ZONE_SIZE : 0;
+    return header->magic == 0xBEEFBEEF && header->version == VERSION &&
+           header->length == imrsim_state_size(*nr_layout) && *nr_layout <= c->nr_zones_default;
+}
+
+/*
+ * To read a copy of the state with its crc table, and the journal, in large bios at once.
+ * Each chunk of the state is checked as it arrives, the damaged pages are left in
+ * state_dirty. A damaged table or page 0, with the config and the number of zones, voids
+ * the copy.
+ */
+static int imrsim_load_state(struct imrsim_c *c, __u32 copy, const struct imrsim_state_header *header,
+                             __u32 nr_layout, __u32 *nr_recs)
+{
+    struct imrsim_md_io io;
+    struct imrsim_md_io jio;
+    struct imrsim_md_io *ios;
+    __u32            num_pages = DIV_ROUND_UP(header->length, PAGE_SIZE);
+    __u32            nr_chunks = DIV_ROUND_UP(num_pages, BIO_MAX_VECS);
+    __u32            first;
+    __u32            end;
+    __u32            pg;
+    __u32            idx;
+    int              ret;
+
+    if(imrsim_state_realloc(c, header->length)){   //vzalloc将申请到连续物理内存数据置为0
+        printk(KERN_ERR "imrsim: zone_state error: no enough memory\n");
+        return -ENOMEM;
+    }
+    // the slots and the journal follow the zones the state was laid out for
+    if(imrsim_reset_zone_maps(c, nr_layout)){
+        return -ENOMEM;
+    }
+    ios = kvmalloc_array(nr_chunks, sizeof(*ios), GFP_KERNEL);
+    if(!ios){
+        printk(KERN_ERR "imrsim: zone_state error: no enough memory\n");
+        return -ENOMEM;
+    }
+    c->zone_state->header = *header;   // to find the crc table
+    imrsim_md_init(&io);
+    imrsim_md_init(&jio);
+    imrsim_journal_read(c, &jio);
+    imrsim_md_read(c, &io, imrsim_state_crc_lba(c, copy), c->state_crcs, imrsim_state_crc_pages(header->length));
+    for(idx = 0; idx < nr_chunks; idx++){
+        first = idx * BIO_MAX_VECS;
+        imrsim_md_init(&ios[idx]);
+        imrsim_md_read(c, &ios[idx], imrsim_state_lba(c, copy) + ((sector_t)first << IMR_PAGE_SIZE_SHIFT_DEFAULT),
+                       (unsigned char *)c->zone_state + (size_t)first * PAGE_SIZE,
+                       min_t(__u32, BIO_MAX_VECS, num_pages - first));
+    }
+    ret = imrsim_md_wait(c, &io, 0);
+    if(!ret && crc32(0, (unsigned char *)c->state_crcs, num_pages * sizeof(__u32)) != header->crc32){
+        ret = -EINVAL;
+    }
+    bitmap_zero(c->state_dirty, num_pages);   // the disk holds it, but the damaged pages
+    for(idx = 0; idx < nr_chunks; idx++){
+        first = idx * BIO_MAX_VECS;
+        end = min_t(__u32, first + BIO_MAX_VECS, num_pages);
+        if(imrsim_md_wait(c, &ios[idx], 0) < 0){
+            bitmap_set(c->state_dirty, first, end - first);
+            continue;
+        }
+        for(pg = first; pg < end && !ret; pg++){
+            if(imrsim_state_page_crc((unsigned char *)c->zone_state + (size_t)pg * PAGE_SIZE, pg) != c->state_crcs[pg]){
+                set_bit(pg, c->state_dirty);
+            }
+        }
+    }
+    if(!ret && test_bit(0, c->state_dirty)){
+        ret = -EINVAL;
+    }
+    *nr_recs = 0;
+    if(!imrsim_md_wait(c, &jio, 0) && !ret){
+        *nr_recs = imrsim_journal_scan(c);
+    }
+    kvfree(ios);
+    return ret;
+}
+
+/*
+ * To load metadata from persistent storage: the newest copy of the state whose header, crc
+ * table and page 0 are sound, then the journal written after it.
+ */
+static int imrsim_load_persistence(struct dm_target *ti)
 {
     __u64            sizedev;
     void             *page_addr;
     struct page      *page;
-    struct imrsim_c  *zdev;
+    struct imrsim_c  *c;
+    struct imrsim_journal_rec *rec;
+    unsigned long    *damaged = NULL;
     __u32            num_pages;
-    __u32            part_page;     
+    __u32            copy = 0;
+    __u32            pg;
     __u32            idx;
-    __u32            crc;
-    struct imrsim_state_header header;
+    __u32            nr_layout[IMR_STATE_COPIES];
+    __u32            nr_recs;
+    __u32            nr_damaged;
+    bool             valid[IMR_STATE_COPIES];
+    bool             found = false;
+    __u32            newest = 0;
+    struct imrsim_state_header header[IMR_STATE_COPIES];
+    int              ret;
 
     printk(KERN_INFO "imrsim: load persistence\n");
 
-    zdev = ti->private;
+    c = ti->private;
     sizedev = ti->len;
-    imrsim_init_zone_default(sizedev);
+    imrsim_init_zone_default(c, sizedev);
     /* The starting address for persistent storage. */
-    imrsim_ptask.pstore_lba = IMR_NUMZONES_DEFAULT      //元数据的起始地址，元数据包括磁盘统计信息和zone状态信息
+    c->ptask.pstore_lba = c->nr_zones_default      //元数据的起始地址，元数据包括磁盘统计信息和zone状态信息
                               << IMR_ZONE_SIZE_SHIFT_DEFAULT
                               << IMR_BLOCK_SIZE_SHIFT_DEFAULT;
-    page = alloc_pages(GFP_KERNEL, 0);
-    if(!page){
-        printk(KERN_ERR "imrsim: no enough memory to allocate a page\n");
-        goto pgerr;
-    }
+    c->state_copy = IMR_STATE_COPIES - 1;   // a new state goes to copy 0 first
+    page = mempool_alloc(c->page_pool, GFP_NOIO);
     page_addr = page_address(page);
     if(!page_addr){
         printk(KERN_ERR "imrsim: read page vm addr null\n");
+        mempool_free(page, c->page_pool);
         goto rderr;
     }
-    memset(page_addr, 0, PAGE_SIZE);
-    imrsim_read_page(zdev->dev->bdev, imrsim_ptask.pstore_lba, PAGE_SIZE, page);
-    memcpy(&header, page_addr, sizeof(struct imrsim_state_header));
-    if(header.magic == 0xBEEFBEEF){
-        zone_state = vzalloc(header.length);  //vzalloc将申请到连续物理内存数据置为0
-        if(!zone_state){
-            printk(KERN_ERR "imrsim: zone_state error: no enough memory\n");
-            goto rderr;
-        }
-        num_pages = div_u64_rem(header.length, PAGE_SIZE, &part_page);
-        if(num_pages){
-            memcpy((unsigned char *)zone_state, page_addr, PAGE_SIZE);  // load header
-        }
-        for(idx = 1; idx < num_pages; idx++){
-            memset(page_addr, 0, PAGE_SIZE);
-            imrsim_read_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                            (idx << IMR_PAGE_SIZE_SHIFT_DEFAULT), PAGE_SIZE, page);
-            memcpy(((unsigned char *)zone_state + 
-                  idx * PAGE_SIZE), page_addr, PAGE_SIZE);
-        }
-        if(part_page){
-            if(num_pages){
-                memset(page_addr, 0, PAGE_SIZE);
-                imrsim_read_page(zdev->dev->bdev, imrsim_ptask.pstore_lba + 
-                                (num_pages << IMR_PAGE_SIZE_SHIFT_DEFAULT), 
-                                PAGE_SIZE, page);
-            }
-            memcpy(((unsigned char *)zone_state + 
-                   idx * PAGE_SIZE), page_addr, part_page);
-        }
-        crc = crc32(0, (unsigned char *)zone_state + sizeof(struct imrsim_state_header), 
-                   zone_state->header.length - sizeof(struct imrsim_state_header));
-        if(crc != zone_state->header.crc32){
-            printk(KERN_ERR "imrsim: error: crc checking. apply default config ...\n");
-            goto rderr;
-        }
-        IMR_NUMZONES = zone_state->stats.num_zones;
-        zone_status = (struct imrsim_zone_status *)&zone_state->stats.zone_stats[IMR_NUMZONES];
-        IMR_ZONE_SIZE_SHIFT = index_power_of_2(zone_status[0].z_length >> IMR_BLOCK_SIZE_SHIFT);
-        printk(KERN_INFO "imrsim: load persist success\n");
-    }else{
-        printk(KERN_ERR "imrsim: load persistence magic doesn't match. Setup the default\n");
+    for(idx = 0; idx < IMR_STATE_COPIES; idx++){
+        memset(page_addr, 0, PAGE_SIZE);
+        valid[idx] = imrsim_read_page(c, c->dev->bdev, imrsim_state_lba(c, idx), PAGE_SIZE, page) >= 0;
+        memcpy(&header[idx], page_addr, sizeof(struct imrsim_state_header));
+        valid[idx] = valid[idx] && imrsim_state_header_valid(c, &header[idx], &nr_layout[idx]);
+        if(valid[idx] && (!found || (__s32)(header[idx].seq - header[copy].seq) > 0)){
+            copy = idx;
+            found = true;
+        }
+    }
+    mempool_free(page, c->page_pool);
+    if(!found){
+        printk(KERN_ERR "imrsim: load persistence magic or version doesn't match. Setup the default\n");
+        goto rderr;
+    }
+    newest = header[copy].seq;
+    // the other copy is older, it is taken when the newest one is damaged
+    for(idx = 0; idx < IMR_STATE_COPIES; idx++, copy = !copy){
+        if(!valid[copy]){
+            continue;
+        }
+        if(!imrsim_load_state(c, copy, &header[copy], nr_layout[copy], &nr_recs)){
+            break;
+        }
+        printk(KERN_ERR "imrsim: error: crc checking of copy %u of the state\n", copy);
+    }
+    if(idx == IMR_STATE_COPIES){
+        goto rderr;
+    }
+    c->state_copy = copy;
+    num_pages = DIV_ROUND_UP(header[copy].length, PAGE_SIZE);
+    damaged = bitmap_zalloc(max_t(__u32, nr_layout[copy], 1), GFP_KERNEL);
+    if(!damaged){
+        printk(KERN_ERR "imrsim: zone_state error: no enough memory\n");
+        goto rderr;
+    }
+    c->nr_zones = c->zone_state->stats.num_zones;
+    if(c->nr_zones > nr_layout[copy]){
+        printk(KERN_ERR "imrsim: error: %u zones in a state of %u\n", c->nr_zones, nr_layout[copy]);
         goto rderr;
     }
-    __free_pages(page, 0);
+    imrsim_state_layout(c, nr_layout[copy]);
+    // only the zones with a part in a damaged page start over
+    for_each_set_bit(pg, c->state_dirty, num_pages){
+        imrsim_state_page_zones(c, pg, nr_layout[copy], damaged);
+    }
+    nr_damaged = 0;
+    for_each_set_bit(idx, damaged, c->nr_zones){
+        imrsim_reset_damaged_zone(c, idx);
+        nr_damaged++;
+    }
+    if(!bitmap_empty(c->state_dirty, num_pages)){
+        printk(KERN_ERR "imrsim: %u damaged pages in the state, %u zones reset\n",
+               bitmap_weight(c->state_dirty, num_pages), nr_damaged);
+        imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
+    }
+    // the other copy is at least a checkpoint behind, the next one writes it whole
+    bitmap_fill(c->prev_dirty, num_pages);
+    c->zone_size_shift = index_power_of_2(c->zone_status[0].z_length >> c->block_size_shift);
+    // the table of a zone is read and checked on its first access
+    for(idx = 0; c->maps_lazy && idx < c->nr_zones; idx++){
+        if(c->zone_status[idx].z_map_size){
+            set_bit(idx, c->maps_lazy);
+        }
+    }
+    for(idx = 0; idx < nr_recs; idx++){
+        rec = imrsim_journal_rec(c, idx);
+        if(rec->zone_idx < c->nr_zones && test_bit(rec->zone_idx, damaged)){
+            continue;   // its mappings went with its state
+        }
+        ret = imrsim_journal_apply(c, rec);
+        if(ret == -EINVAL){
+            goto rderr;   // the journal is damaged
+        }
+        if(ret){
+            // only the zone starts over, the other zones keep replaying their records
+            imrsim_reset_failed_zone(c, rec->zone_idx);
+            set_bit(rec->zone_idx, damaged);
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
+            printk(KERN_ERR "imrsim: zone %u reset, its mappings are lost\n", rec->zone_idx);
+        }
+    }
+    imrsim_journal_reset(c);
+    if(nr_recs){
+        // a checkpoint comes before the journal is written again
+        imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
+        printk(KERN_INFO "imrsim: %u journal records replayed\n", nr_recs);
+    }
+    printk(KERN_INFO "imrsim: load persist success from copy %u\n", copy);
+    bitmap_free(damaged);
     return 0;
     rderr:
-        __free_pages(page, 0);
-    pgerr:
-        imrsim_init_zone_state(sizedev);
+        bitmap_free(damaged);
+        imrsim_init_zone_state(c, sizedev);
+        imrsim_journal_reset(c);
+        if(found && c->zone_state){
+            // the copies left on the disk never win over the new state
+            c->zone_state->header.seq = newest + 1;
+        }
     return -EINVAL;
 }
 
-/* persistent storage task */
+/*
+ * To get when the persistence thread must run at the latest: max_stale after the first
+ * journal record not written, and the next checkpoint once anything changed.
+ */
+static bool imrsim_pstore_deadline(struct imrsim_c *c, unsigned long *deadline)
+{
+    unsigned long t;
+    bool armed = false;
+
+    if(READ_ONCE(c->journal.dirty)){
+        *deadline = READ_ONCE(c->journal.since) + msecs_to_jiffies(c->ptask.max_stale);
+        armed = true;
+    }
+    if(READ_ONCE(c->ptask.flag)){
+        t = READ_ONCE(c->journal.checkpoint) + msecs_to_jiffies(IMR_JOURNAL_CHECKPOINT);
+        if(!armed || time_before(t, *deadline)){
+            *deadline = t;
+        }
+        armed = true;
+    }
+    return armed;
+}
+
+static bool imrsim_pstore_ready(struct imrsim_c *c)
+{
+    unsigned long deadline;
+
+    return (READ_ONCE(c->ptask.flag) & IMR_CONFIG_CHANGE) ||
+           READ_ONCE(c->journal.pending) >= c->ptask.min_batch ||
+           (imrsim_pstore_deadline(c, &deadline) && time_after_eq(jiffies, deadline));
+}
+
+/*
+ * persistent storage task: it sleeps until a configuration change, min_batch journal
+ * records or a deadline, then writes the journal or takes a checkpoint.
+ */
 static int imrsim_persistence_task(void *arg)
 {
     struct dm_target *ti = (struct dm_target *)arg;
-
-    while(!kthread_should_stop()){
-        if(imrsim_ptask.flag){
-            mutex_lock(&imrsim_zone_lock);
-            if(imrsim_ptask.flag & IMR_CONFIG_CHANGE){
-                if(IMR_NUMZONES == 0){
-                    imrsim_ptask.flag &= IMR_NO_CHANGE;
-                }else{
-                    imrsim_save_persistence(ti);
-                    imrsim_ptask.flag &= IMR_NO_CHANGE;
-                }
-            }else{
-                if(imrsim_ptask.stu_zone_idx_gap >= IMR_PSTORE_PG_GAP){
-                    imrsim_save_persistence(ti);
-                    imrsim_ptask.flag &= IMR_NO_CHANGE;
-                    imrsim_ptask.stu_zone_idx_gap = 0;
-                    memset(imrsim_ptask.stu_zone_idx, 0, sizeof(__u32) * IMR_PSTORE_QDEPTH);
-                    imrsim_ptask.stu_zone_idx_cnt = 0;
-                }else{
-                    imrsim_flush_persistence(ti);
-                }
-            }
-            mutex_unlock(&imrsim_zone_lock);
+    struct imrsim_c *c = ti->private;
+    unsigned long deadline;
+    long timeout;
+    bool armed;
+    int ret;
+
+    while(!kthread_should_stop()){
+        armed = imrsim_pstore_deadline(c, &deadline);
+        timeout = MAX_SCHEDULE_TIMEOUT;
+        if(armed){
+            timeout = time_after(deadline, jiffies) ? (long)(deadline - jiffies) : 0;
+        }
+        // an idle thread is woken by the first change to arm its deadline
+        wait_event_interruptible_timeout(c->ptask.wait, kthread_should_stop() || imrsim_pstore_ready(c) ||
+                                         (!armed && imrsim_pstore_deadline(c, &deadline)), timeout);
+        if(kthread_should_stop() || !imrsim_pstore_ready(c)){
+            continue;
+        }
+        if((READ_ONCE(c->ptask.flag) & IMR_CONFIG_CHANGE) || imrsim_journal_due(c)){
+            ret = imrsim_checkpoint(ti);
+        }else{
+            ret = imrsim_flush_persistence(ti);
+        }
+        if(ret < 0){
+            schedule_timeout_interruptible(msecs_to_jiffies(c->ptask.max_stale));   // not retried at once
         }
-        msleep_interruptible(IMR_PSTORE_CHECK);
+    }
+    // the device is quiet, a last checkpoint spares the replay of the journal at the next load
+    if(c->ptask.flag || c->journal.dirty || c->journal.head){
+        imrsim_checkpoint(ti);
     }
     return 0;
 }
 
-/* persistent storage thread */
+/* persistent storage thread, the first one loads the metadata */
 static int imrsim_persistence_thread(struct dm_target *ti)
 {
+    struct imrsim_c *c;
     int ret = 0;
 
     if(!ti){
         printk(KERN_ERR "imrsim: warning: null device target. Improper usage\n");
         return -EINVAL;
     }
-    imrsim_ptask.flag = 0;
-    imrsim_ptask.stu_zone_idx_cnt = 0;
-    imrsim_ptask.stu_zone_idx_gap = 0;
-    memset(imrsim_ptask.stu_zone_idx, 0, sizeof(__u32) * IMR_PSTORE_QDEPTH);
-    ret = imrsim_load_persistence(ti);
-    if(ret){
-        imrsim_save_persistence(ti);
-    }
-    // create thread
-    imrsim_ptask.pstore_thread = kthread_create(imrsim_persistence_task, 
-                                                ti, "imrsim pthread");
-    if(imrsim_ptask.pstore_thread){
-        printk(KERN_INFO "imrsim persistence thread created\n");
-        // After a thread is created with kthread_create, the thread will not start immediately, 
-		// but needs to be started after calling the wake_up_process function.
-        wake_up_process(imrsim_ptask.pstore_thread);
-    }else{
-        printk(KERN_ERR "imrsim persistence thread create failed\n");
-        return -EAGAIN;
+    c = ti->private;
+    if(!c->ptask.loaded){
+        c->ptask.flag = 0;
+        ret = imrsim_load_persistence(ti);
+        if(ret){
+            imrsim_checkpoint(ti);
+        }
+        c->ptask.loaded = true;
     }
+    // create thread, one per target
+    c->ptask.pstore_thread = kthread_create(imrsim_persistence_task, ti, "imrsim_pstore/%s",
+                                            dm_device_name(dm_table_get_md(ti->table)));
+    if(IS_ERR(c->ptask.pstore_thread)){
+        ret = PTR_ERR(c->ptask.pstore_thread);
+        c->ptask.pstore_thread = NULL;
+        printk(KERN_ERR "imrsim persistence thread create failed: %d\n", ret);
+        return ret;
+    }
+    printk(KERN_INFO "imrsim persistence thread created\n");
+    // After a thread is created with kthread_create, the thread will not start immediately, 
+    // but needs to be started after calling the wake_up_process function.
+    wake_up_process(c->ptask.pstore_thread);
     return 0;
 }
 
 /* To update device idle time. */
 /*更新设备空闲时间*/
-static void imrsim_dev_idle_update(void)
+static void imrsim_dev_idle_update(struct imrsim_c *c)
 {
     __u32 dt = 0;
-    if(jiffies > imrsim_dev_idle_checkpoint){            //  Jiffies记录系统自开机以来，已经过了多少tick。
-        dt = (jiffies - imrsim_dev_idle_checkpoint) / HZ;//每发生一次timer interrupt，Jiffies变数会被加一。
+
+    if(jiffies > c->idle_checkpoint){            //  Jiffies记录系统自开机以来，已经过了多少tick。
+        dt = (jiffies - c->idle_checkpoint) / HZ;//每发生一次timer interrupt，Jiffies变数会被加一。
     }else{
-        dt = (~(__u32)0 - imrsim_dev_idle_checkpoint + jiffies) / HZ;
+        dt = (~(__u32)0 - c->idle_checkpoint + jiffies) / HZ;
     }
-    if (dt > zone_state->stats.dev_stats.idle_stats.dev_idle_time_max) {
-      zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = dt;
-   } else if (dt && (dt < zone_state->stats.dev_stats.idle_stats.dev_idle_time_min)) {
-      zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = dt;
+    // Most of the I/O changes nothing, they do not contend on the lock for it.
+    if(dt <= READ_ONCE(c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_max) &&
+       (!dt || dt >= READ_ONCE(c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_min))){
+        return;
+    }
+    spin_lock(&c->stats_lock);
+    if (dt > c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_max) {
+      c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = dt;
+   } else if (dt && (dt < c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_min)) {
+      c->zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = dt;
    }
+   spin_unlock(&c->stats_lock);
 }
 
 /* status report */
@@ -800,11 +2874,12 @@ static void imrsim_report_stats(struct imrsim_stats *stats)
 /* The following are interface methods with EXPORT_SYMBOL. */
 
 /* To get the last read error. */
-int imrsim_get_last_rd_error(__u32 *last_error)
+int imrsim_get_last_rd_error(struct dm_target *ti, __u32 *last_error)
 {
-    __u32 tmperr = imrsim_dbg_rerr;
+    struct imrsim_c *c = ti->private;
+    __u32 tmperr = c->dbg_rerr;
 
-    imrsim_dbg_rerr = 0;
+    c->dbg_rerr = 0;
     if(last_error){
         *last_error = tmperr;
     }
@@ -813,11 +2888,12 @@ int imrsim_get_last_rd_error(__u32 *last_error)
 EXPORT_SYMBOL(imrsim_get_last_rd_error);
 
 /* To get the last write error. */
-int imrsim_get_last_wd_error(__u32 *last_error)
+int imrsim_get_last_wd_error(struct dm_target *ti, __u32 *last_error)
 {
-   __u32 tmperr = imrsim_dbg_werr;
+   struct imrsim_c *c = ti->private;
+   __u32 tmperr = c->dbg_werr;
 
-   imrsim_dbg_werr  = 0;
+   c->dbg_werr  = 0;
    if(last_error)
       *last_error = tmperr;
    return 0;
@@ -825,228 +2901,264 @@ int imrsim_get_last_wd_error(__u32 *last_error)
 EXPORT_SYMBOL(imrsim_get_last_wd_error);
 
 /* Enable logging. */
-int imrsim_set_log_enable(__u32 zero_is_disable)
+int imrsim_set_log_enable(struct dm_target *ti, __u32 zero_is_disable)
 {
-   imrsim_dbg_log_enabled = zero_is_disable;
+   struct imrsim_c *c = ti->private;
+
+   c->dbg_log_enabled = zero_is_disable;
    return 0;
 }
 EXPORT_SYMBOL(imrsim_set_log_enable);
 
 /* Disable logging. */
-int imrsim_get_num_zones(__u32* num_zones)
+int imrsim_get_num_zones(struct dm_target *ti, __u32* num_zones)
 {
+   struct imrsim_c *c = ti->private;
+
    printk(KERN_INFO "imrsim: %s: called.\n", __FUNCTION__);
    if (!num_zones) {
       printk(KERN_ERR "imrsim: NULL pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&imrsim_zone_lock);
-   *num_zones = IMR_NUMZONES;
-   mutex_unlock(&imrsim_zone_lock);
+   down_read(&c->state_lock);
+   *num_zones = c->nr_zones;
+   up_read(&c->state_lock);
    return 0;
 }
 EXPORT_SYMBOL(imrsim_get_num_zones);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To get the number of sectors in a zone. */
 /*计算一个zone有多少扇区*/
-int imrsim_get_size_zone_default(__u32 *size_zone)
+int imrsim_get_size_zone_default(struct dm_target *ti, __u32 *size_zone)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!size_zone){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    *size_zone = num_sectors_zone();
-    mutex_unlock(&imrsim_zone_lock);
+    down_read(&c->state_lock);
+    *size_zone = num_sectors_zone(c);
+    up_read(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_get_size_zone_default);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To set the default zone size. */
-int imrsim_set_size_zone_default(__u32 size_zone)
+int imrsim_set_size_zone_default(struct dm_target *ti, __u32 size_zone)
 {
-    struct imrsim_state *sta_tmp;
+    struct imrsim_c *c = ti->private;
 
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    if((size_zone % (1 << IMR_BLOCK_SIZE_SHIFT)) || !(is_power_of_2(size_zone))){
+    if((size_zone % (1 << c->block_size_shift)) || !(is_power_of_2(size_zone))){
         printk(KERN_ERR "imrsim: Wrong zone size specified\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    IMR_ZONE_SIZE_SHIFT = index_power_of_2((size_zone) >> IMR_BLOCK_SIZE_SHIFT);
-    IMR_NUMZONES = ((IMR_CAPACITY >> IMR_BLOCK_SIZE_SHIFT) >> IMR_ZONE_SIZE_SHIFT);
-    sta_tmp = vzalloc(imrsim_state_size());
-    if(!sta_tmp){
-        mutex_unlock(&imrsim_zone_lock);
+    if((size_zone >> c->block_size_shift) > TOTAL_ITEMS){   // the offsets in the mapping table are 16-bit
+        printk(KERN_ERR "imrsim: zone size is larger than the mapping table\n");
+        return -EINVAL;
+    }
+    if(imrsim_state_size((c->capacity >> c->block_size_shift) / (size_zone >> c->block_size_shift)) > U32_MAX){
+        printk(KERN_ERR "imrsim: zone size is too small, the state of the zones exceeds 4GB\n");
+        return -EINVAL;
+    }
+    // the copies of the state, the slots and the journal are laid out for the default zones
+    if(((c->capacity >> c->block_size_shift) >> index_power_of_2(size_zone >> c->block_size_shift)) >
+       c->nr_zones_default){
+        printk(KERN_ERR "imrsim: zone size is too small, the metadata area holds %u zones\n",
+               c->nr_zones_default);
+        return -EINVAL;
+    }
+    down_write(&c->state_lock);
+    c->zone_size_shift = index_power_of_2((size_zone) >> c->block_size_shift);
+    c->nr_zones = ((c->capacity >> c->block_size_shift) >> c->zone_size_shift);
+    if(imrsim_reset_zone_maps(c, c->nr_zones) || imrsim_state_realloc(c, imrsim_state_size(c->nr_zones))){
+        up_write(&c->state_lock);
         printk(KERN_ERR "imrsim: zone_state memory realloc failed\n");
         return -EINVAL;
     }
-    vfree(zone_state);
-    zone_state = sta_tmp;
-    imrsim_init_zone_state_default(imrsim_state_size());
-    mutex_unlock(&imrsim_zone_lock);
+    imrsim_init_zone_state_default(c, imrsim_state_size(c->nr_zones));
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_set_size_zone_default);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To reset default config. */
-int imrsim_reset_default_config(void)
+int imrsim_reset_default_config(struct dm_target *ti)
 {
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    imrsim_reset_default_zone_config();
-    imrsim_reset_default_device_config();
+    imrsim_reset_default_zone_config(ti);
+    imrsim_reset_default_device_config(ti);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_reset_default_config);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To reset default device config. */
-int imrsim_reset_default_device_config(void)
+int imrsim_reset_default_device_config(struct dm_target *ti)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->config.dev_config.out_of_policy_read_flag = 0;
-    zone_state->config.dev_config.out_of_policy_write_flag = 0;
-    zone_state->config.dev_config.r_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
-    zone_state->config.dev_config.w_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
-    mutex_unlock(&imrsim_zone_lock);
+    down_write(&c->state_lock);
+    c->zone_state->config.dev_config.out_of_policy_read_flag = 0;
+    c->zone_state->config.dev_config.out_of_policy_write_flag = 0;
+    c->zone_state->config.dev_config.r_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
+    c->zone_state->config.dev_config.w_time_to_rmw_zone = IMR_TRANSFER_PENALTY;
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_reset_default_device_config);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To get device config. */
-int imrsim_get_device_config(struct imrsim_dev_config *device_config)
+int imrsim_get_device_config(struct dm_target *ti, struct imrsim_dev_config *device_config)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!device_config){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    memcpy(device_config, &(zone_state->config.dev_config), 
+    down_read(&c->state_lock);   // only copied out, the I/O goes on
+    memcpy(device_config, &(c->zone_state->config.dev_config), 
            sizeof(struct imrsim_dev_config));
-    mutex_unlock(&imrsim_zone_lock);
+    up_read(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_get_device_config);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To set device read config. */
-int imrsim_set_device_rconfig(struct imrsim_dev_config *device_config)
+int imrsim_set_device_rconfig(struct dm_target *ti, struct imrsim_dev_config *device_config)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!device_config){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->config.dev_config.out_of_policy_read_flag = 
+    down_write(&c->state_lock);
+    c->zone_state->config.dev_config.out_of_policy_read_flag = 
         device_config->out_of_policy_read_flag;
-    mutex_unlock(&imrsim_zone_lock);
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_set_device_rconfig);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To set device write config. */
-int imrsim_set_device_wconfig(struct imrsim_dev_config *device_config)
+int imrsim_set_device_wconfig(struct dm_target *ti, struct imrsim_dev_config *device_config)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!device_config){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->config.dev_config.out_of_policy_write_flag = 
+    down_write(&c->state_lock);
+    c->zone_state->config.dev_config.out_of_policy_write_flag = 
         device_config->out_of_policy_write_flag;
-    mutex_unlock(&imrsim_zone_lock);
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_set_device_wconfig);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To set read delay. */
-int imrsim_set_device_rconfig_delay(struct imrsim_dev_config *device_config)
+int imrsim_set_device_rconfig_delay(struct dm_target *ti, struct imrsim_dev_config *device_config)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!device_config){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    if(device_config->r_time_to_rmw_zone >= IMR_TRANSFER_PENALTY_MAX){
+    if(device_config->r_time_to_rmw_zone > IMR_TRANSFER_PENALTY_MAX){
         printk(KERN_ERR "time delay exceeds default maximum\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->config.dev_config.r_time_to_rmw_zone = 
+    down_write(&c->state_lock);
+    c->zone_state->config.dev_config.r_time_to_rmw_zone = 
         device_config->r_time_to_rmw_zone;
-    mutex_unlock(&imrsim_zone_lock);
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_set_device_rconfig_delay);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To set write delay. */
-int imrsim_set_device_wconfig_delay(struct imrsim_dev_config *device_config)
+int imrsim_set_device_wconfig_delay(struct dm_target *ti, struct imrsim_dev_config *device_config)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!device_config){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    if(device_config->w_time_to_rmw_zone >= IMR_TRANSFER_PENALTY_MAX){
+    if(device_config->w_time_to_rmw_zone > IMR_TRANSFER_PENALTY_MAX){
         printk(KERN_ERR "time delay exceeds default maximum\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->config.dev_config.w_time_to_rmw_zone = 
+    down_write(&c->state_lock);
+    c->zone_state->config.dev_config.w_time_to_rmw_zone = 
         device_config->w_time_to_rmw_zone;
-    mutex_unlock(&imrsim_zone_lock);
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_set_device_wconfig_delay);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To reset default zone config. */
-int imrsim_reset_default_zone_config(void)
+int imrsim_reset_default_zone_config(struct dm_target *ti)
 {
-    struct imrsim_state *sta_tmp;
+    struct imrsim_c *c = ti->private;
 
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    mutex_lock(&imrsim_zone_lock);
-    IMR_NUMZONES = IMR_NUMZONES_DEFAULT;
-    IMR_ZONE_SIZE_SHIFT = IMR_ZONE_SIZE_SHIFT_DEFAULT;
-    sta_tmp = vzalloc(imrsim_state_size());
-    vfree(zone_state);
-    if(!sta_tmp){
+    down_write(&c->state_lock);
+    c->nr_zones = c->nr_zones_default;
+    c->zone_size_shift = IMR_ZONE_SIZE_SHIFT_DEFAULT;
+    if(imrsim_reset_zone_maps(c, c->nr_zones) || imrsim_state_realloc(c, imrsim_state_size(c->nr_zones))){
+        up_write(&c->state_lock);
         printk(KERN_ERR "imrsim: zone_state memory realloc failed\n");
         return -EINVAL;
     }
-    zone_state = sta_tmp;
-    imrsim_init_zone_state_default(imrsim_state_size());
-    mutex_unlock(&imrsim_zone_lock);
+    imrsim_init_zone_state_default(c, imrsim_state_size(c->nr_zones));
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_reset_default_zone_config);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To clear config of a zone. */
-int imrsim_clear_zone_config(void)
+int imrsim_clear_zone_config(struct dm_target *ti)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    memset(zone_state->stats.zone_stats, 0, 
-       zone_state->stats.num_zones * sizeof(struct imrsim_zone_stats));
-    mutex_lock(&imrsim_zone_lock);
-    zone_state->stats.num_zones = 0;
-    memset(zone_status, 0, IMR_NUMZONES * sizeof(struct imrsim_zone_status));
-    IMR_NUMZONES = 0;
-    mutex_unlock(&imrsim_zone_lock);
+    down_write(&c->state_lock);
+    memset(c->zone_state->stats.zone_stats, 0, 
+       c->zone_state->stats.num_zones * sizeof(struct imrsim_zone_stats));
+    imrsim_state_dirty(c, c->zone_state->stats.zone_stats,
+                       c->zone_state->stats.num_zones * sizeof(struct imrsim_zone_stats));
+    c->zone_state->stats.num_zones = 0;
+    memset(c->zone_status, 0, c->nr_zones * sizeof(struct imrsim_zone_status));
+    memset(c->zone_tracks, 0, (size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+    imrsim_state_dirty(c, c->zone_status, (unsigned char *)&c->zone_tracks[(size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL] -
+                       (unsigned char *)c->zone_status);
+    c->nr_zones = 0;
+    imrsim_reset_zone_maps(c, c->nr_maps);   // keeps the array, cannot fail
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_clear_zone_config);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* Count the number of Z_TYPE_SEQUENTIAL type zones. @Deprecated */
-static int imrsim_zone_seq_count(void)
+static int imrsim_zone_seq_count(struct imrsim_c *c)
 {
     __u32 count = 0;
     __u32 index;
 
-    for(index = 0; index < IMR_NUMZONES; index++){
-        if(zone_status[index].z_type == Z_TYPE_SEQUENTIAL){
+    for(index = 0; index < c->nr_zones; index++){
+        if(c->zone_status[index].z_type == Z_TYPE_SEQUENTIAL){
             count++;
         }
     }
@@ -1071,26 +3183,27 @@ static int imrsim_zone_cond_check(__u16 cond)
 }
 
 /* To modify zone configuration. @Deprecated */
-int imrsim_modify_zone_config(struct imrsim_zone_status *z_status)
+int imrsim_modify_zone_config(struct dm_target *ti, struct imrsim_zone_status *z_status)
 {
-    __u32 count = imrsim_zone_seq_count();
+    struct imrsim_c *c = ti->private;
+    __u32 count = imrsim_zone_seq_count(c);
 
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__); 
     if(!z_status){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    if(IMR_NUMZONES <= z_status->z_start){
+    if(c->nr_zones <= z_status->z_start){
         printk(KERN_ERR "imrsim: config does not exist\n");
         return -EINVAL;
     }
     if(1 >= count && (Z_TYPE_SEQUENTIAL == z_status->z_type) &&
-      (Z_TYPE_SEQUENTIAL == zone_status[z_status->z_start].z_type))
+      (Z_TYPE_SEQUENTIAL == c->zone_status[z_status->z_start].z_type))
     {
           printk(KERN_ERR "imrsim: zone type is not allowed to modify\n");
           return -EINVAL;
     }
-    if(z_status->z_length != num_sectors_zone()){
+    if(z_status->z_length != num_sectors_zone(c)){
         printk(KERN_ERR "imrsim: zone size is not allowed to change individually\n");
         return -EINVAL;
     }
@@ -1110,37 +3223,42 @@ int imrsim_modify_zone_config(struct imrsim_zone_status *z_status)
       return -EINVAL;
     }
 
-    mutex_lock(&imrsim_zone_lock);
-    zone_status[z_status->z_start].z_conds = 
+    down_read(&c->state_lock);
+    mutex_lock(imrsim_zone_lock(c, z_status->z_start));
+    c->zone_status[z_status->z_start].z_conds = 
       (enum imrsim_zone_conditions)z_status->z_conds;
-    zone_status[z_status->z_start].z_type = 
+    c->zone_status[z_status->z_start].z_type = 
       (enum imrsim_zone_type)z_status->z_type;
-    zone_status[z_status->z_start].z_flag = 0;
-    mutex_unlock(&imrsim_zone_lock);
+    c->zone_status[z_status->z_start].z_flag = 0;
+    imrsim_state_dirty(c, &c->zone_status[z_status->z_start], sizeof(struct imrsim_zone_status));
+    mutex_unlock(imrsim_zone_lock(c, z_status->z_start));
+    up_read(&c->state_lock);
     printk(KERN_DEBUG "imrsim: zone[%lu] modified. type:0x%x conds:0x%x\n",
-      zone_status[z_status->z_start].z_start,
-      zone_status[z_status->z_start].z_type, 
-      zone_status[z_status->z_start].z_conds);
+      c->zone_status[z_status->z_start].z_start,
+      c->zone_status[z_status->z_start].z_type, 
+      c->zone_status[z_status->z_start].z_conds);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_modify_zone_config);////使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To add zone configuration. @Deprecated */
-int imrsim_add_zone_config(struct imrsim_zone_status *zone_sts)
+int imrsim_add_zone_config(struct dm_target *ti, struct imrsim_zone_status *zone_sts)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!zone_sts){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    if(zone_sts->z_start >= IMR_NUMZONES_DEFAULT){
+    if(zone_sts->z_start >= c->nr_zones_default){
         printk(KERN_ERR "imrsim: zone config start lba is out of range\n");
         return -EINVAL;
     }
-    if(zone_sts->z_start != IMR_NUMZONES){
+    if(zone_sts->z_start != c->nr_zones){
         printk(KERN_ERR "imrsim: zone config does not start at the end of current zone\n");
-        printk(KERN_INFO "imrsim: z_start: %u  IMR_NUMZONES: %u\n", (__u32)zone_sts->z_start,
-             IMR_NUMZONES);
+        printk(KERN_INFO "imrsim: z_start: %u  nr_zones: %u\n", (__u32)zone_sts->z_start,
+             c->nr_zones);
         return -EINVAL;
     }
     if ((zone_sts->z_type != Z_TYPE_CONVENTIONAL) && (zone_sts->z_type != Z_TYPE_SEQUENTIAL)) {
@@ -1155,616 +3273,1082 @@ int imrsim_add_zone_config(struct imrsim_zone_status *zone_sts)
       printk(KERN_ERR "imrsim: zone config condition is wrong. Need to be EMPTY\n");
       return -EINVAL;
    }
-   if (zone_sts->z_length != (1 << IMR_ZONE_SIZE_SHIFT << IMR_BLOCK_SIZE_SHIFT)) {
+   if (zone_sts->z_length != (1 << c->zone_size_shift << c->block_size_shift)) {
       printk(KERN_ERR "imrsim: zone config size is not allowed with current config\n");
       return -EINVAL;
    }
    zone_sts->z_flag = 0;
-   mutex_lock(&imrsim_zone_lock);
-   memcpy(&(zone_status[IMR_NUMZONES]), zone_sts, sizeof(struct imrsim_zone_status));
-   zone_state->stats.num_zones++;
-   IMR_NUMZONES++;
-   mutex_unlock(&imrsim_zone_lock);
+   zone_sts->z_map_size = 0;   // the zone starts with nothing mapped
+   down_write(&c->state_lock);
+   if(c->nr_zones >= c->nr_maps){
+      up_write(&c->state_lock);
+      printk(KERN_ERR "imrsim: zone config is beyond the zones of the current zone size\n");
+      return -EINVAL;
+   }
+   memcpy(&(c->zone_status[c->nr_zones]), zone_sts, sizeof(struct imrsim_zone_status));
+   memset(&c->zone_tracks[(size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL], 0,
+          TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+   imrsim_state_dirty(c, &c->zone_status[c->nr_zones], sizeof(struct imrsim_zone_status));
+   imrsim_state_dirty(c, &c->zone_tracks[(size_t)c->nr_zones * TOP_TRACK_NUM_TOTAL],
+                      TOP_TRACK_NUM_TOTAL * sizeof(struct imrsim_zone_track));
+   c->zone_state->stats.num_zones++;
+   c->nr_zones++;
+   up_write(&c->state_lock);
    return 0;
 }
 EXPORT_SYMBOL(imrsim_add_zone_config);////使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To reset statistics for a zone. */
 /*重置zone的统计信息。*/
-int imrsim_reset_zone_stats(sector_t start_sector)
+int imrsim_reset_zone_stats(struct dm_target *ti, sector_t start_sector)
 {
-    __u32 zone_idx = start_sector >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;   //lba所在的zone编号zone_idx
+    struct imrsim_c *c = ti->private;
+    __u32 zone_idx = start_sector >> c->block_size_shift >> c->zone_size_shift;   //lba所在的zone编号zone_idx
                                                                                     //除以一个zone的块数量以及一个块的扇区数量就可以获得
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    if(IMR_NUMZONES <= zone_idx){
+    down_read(&c->state_lock);
+    if(c->nr_zones <= zone_idx){
+        up_read(&c->state_lock);
         printk(KERN_ERR "imrsim: %s start sector is out of range\n", __FUNCTION__);
         return -EINVAL;
     }
-    memset(&(zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats),
+    mutex_lock(imrsim_zone_lock(c, zone_idx));
+    spin_lock(&c->stats_lock);   // the reads count without the zone lock
+    memset(&(c->zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats),
           0, sizeof(struct imrsim_out_of_policy_read_stats));
-    memset(&(zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats),
+    spin_unlock(&c->stats_lock);
+    memset(&(c->zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats),
           0, sizeof(struct imrsim_out_of_policy_write_stats));
-    memset(&(zone_state->stats.zone_stats[zone_idx].z_extra_write_total),
+    memset(&(c->zone_state->stats.zone_stats[zone_idx].z_extra_write_total),
           0, sizeof(__u32));
-    memset(&(zone_state->stats.zone_stats[zone_idx].z_write_total),
+    memset(&(c->zone_state->stats.zone_stats[zone_idx].z_write_total),
           0, sizeof(__u32));
+    imrsim_state_dirty(c, &c->zone_state->stats.zone_stats[zone_idx], sizeof(struct imrsim_zone_stats));
+    mutex_unlock(imrsim_zone_lock(c, zone_idx));
+    up_read(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_reset_zone_stats);  //使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
-/* To reset zone_stats. */
+/* To reset zone_stats, the caller holds imrsim_state_lock exclusively. */
 /*重置zone_stats*/
-int imrsim_reset_stats(void)
+static void __imrsim_reset_stats(struct imrsim_c *c)
 {
-    printk(KERN_INFO "imrsim: %s: called.\n", __FUNCTION__);
-    memset(&zone_state->stats.dev_stats.idle_stats, 0, sizeof(struct imrsim_idle_stats));
-    memset(&zone_state->stats.extra_write_total, 0, sizeof(__u64));
-    memset(&zone_state->stats.write_total, 0, sizeof(__u64)); //memset(void *s, int ch, size_t n) 
-    memset(zone_state->stats.zone_stats, 0, zone_state->stats.num_zones * //将s中当前位置后面的n个字节 （typedef unsigned int size_t ）
+    memset(&c->zone_state->stats.dev_stats.idle_stats, 0, sizeof(struct imrsim_idle_stats));
+    memset(&c->zone_state->stats.extra_write_total, 0, sizeof(__u64));
+    memset(&c->zone_state->stats.write_total, 0, sizeof(__u64)); //memset(void *s, int ch, size_t n) 
+    memset(c->zone_state->stats.zone_stats, 0, c->zone_state->stats.num_zones * //将s中当前位置后面的n个字节 （typedef unsigned int size_t ）
           sizeof(struct imrsim_zone_stats));                              //用 ch 替换并返回 s。对结构体或数组清零最快的方法
+    imrsim_state_dirty(c, c->zone_state->stats.zone_stats,
+                       c->zone_state->stats.num_zones * sizeof(struct imrsim_zone_stats));
+}
+
+/* To reset zone_stats. */
+int imrsim_reset_stats(struct dm_target *ti)
+{
+    struct imrsim_c *c = ti->private;
+
+    printk(KERN_INFO "imrsim: %s: called.\n", __FUNCTION__);
+    down_write(&c->state_lock);
+    __imrsim_reset_stats(c);
+    up_write(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_reset_stats);  //使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* To get zone_stats. */
-int imrsim_get_stats(struct imrsim_stats *stats)
+int imrsim_get_stats(struct dm_target *ti, struct imrsim_stats *stats)
 {
+    struct imrsim_c *c = ti->private;
+
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
     if(!stats){
         printk(KERN_ERR "imrsim: NULL pointer passed through\n");
         return -EINVAL;
     }
-    memcpy(stats, &(zone_state->stats), imrsim_stats_size()); //拷贝函数，将zone_state->stats拷贝到stats
+    // only copied out, the I/O goes on and the zones are counted as they go
+    down_read(&c->state_lock);
+    spin_lock(&c->stats_lock);
+    memcpy(stats, &(c->zone_state->stats), offsetof(struct imrsim_stats, zone_stats));
+    spin_unlock(&c->stats_lock);
+    memcpy(stats->zone_stats, c->zone_state->stats.zone_stats,
+           imrsim_stats_size(c) - offsetof(struct imrsim_stats, zone_stats)); //拷贝函数，将zone_state->stats拷贝到stats
+    up_read(&c->state_lock);
     return 0;
 }
 EXPORT_SYMBOL(imrsim_get_stats); //使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
 /* @Deprecated */
-int imrsim_blkdev_reset_zone_ptr(sector_t start_sector)
+int imrsim_blkdev_reset_zone_ptr(struct dm_target *ti, sector_t start_sector)
 {
+    struct imrsim_c *c = ti->private;
     //__u32 rem;
     __u32 zone_idx;
 
     printk(KERN_INFO "imrsim: %s called.\n", __FUNCTION__);
-    mutex_lock(&imrsim_zone_lock);
-    zone_idx = start_sector >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;
-    if(IMR_NUMZONES <= zone_idx){
-        mutex_unlock(&imrsim_zone_lock);
+    down_read(&c->state_lock);
+    zone_idx = start_sector >> c->block_size_shift >> c->zone_size_shift;
+    if(c->nr_zones <= zone_idx){
+        up_read(&c->state_lock);
         printk(KERN_ERR "imrsim: %s start_sector is out of range\n", __FUNCTION__);
         return -EINVAL;
     }
-    if (zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
-      mutex_unlock(&imrsim_zone_lock);
-      printk(KERN_ERR "imrsim:error: CMR zone dosen't have a write pointer.\n");
-      return -EINVAL;
+    if (c->zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
+      up_read(&c->state_lock);
+      printk(KERN_ERR "imrsim:error: CMR zone dosen't have a write pointer.\n");
+      return -EINVAL;
+    }
+    up_read(&c->state_lock);
+    return 0;
+}
+EXPORT_SYMBOL(imrsim_blkdev_reset_zone_ptr);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
+
+/* error log */
+void imrsim_log_error(struct imrsim_c *c, struct bio* bio, __u32 uerr)
+{
+    __u64 lba;
+
+    if (!bio) {
+        printk(KERN_ERR "imrsim: NULL pointer passed through\n");
+        return;
+    }
+    lba = bio->bi_iter.bi_sector;
+    if (c->dbg_log_enabled) {
+        switch(uerr)
+        {
+            case IMR_ERR_READ_BORDER:
+                printk(KERN_DEBUG "%s: lba:%llu IMR_ERR_READ_BORDER\n", __FUNCTION__, lba);
+                c->dbg_rerr = uerr;
+                break;
+            case IMR_ERR_READ_POINTER: 
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_READ_POINTER\n",__FUNCTION__, lba);
+                c->dbg_rerr = uerr;
+                break;
+            case IMR_ERR_WRITE_RO:
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_RO\n", __FUNCTION__, lba);
+                c->dbg_werr = uerr;
+                break;
+            case IMR_ERR_WRITE_POINTER :
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_POINTER\n",__FUNCTION__, lba);
+                c->dbg_werr = uerr;
+                break;
+            case IMR_ERR_WRITE_ALIGN :
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_ALIGN\n", __FUNCTION__, lba);
+                c->dbg_werr = uerr;
+                break;
+            case IMR_ERR_WRITE_BORDER:
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_BORDER\n", __FUNCTION__, lba);
+                c->dbg_werr = uerr;
+                break;
+            case IMR_ERR_WRITE_FULL:
+                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_FULL\n", __FUNCTION__, lba);
+                c->dbg_werr = uerr;
+                break;
+            default:
+                printk(KERN_DEBUG "%s: lba:%llu: UNKNOWN ERR=%u\n", __FUNCTION__, lba, uerr);
+        }
+    }
+}
+
+/* The following is the relevant method to build the target_type structure. */
+/*
+ * To parse the optional table features:
+ * [<#features> rmw_fua|rmw_flush map_block|map_extent max_stale <msec> min_batch <records>]
+ */
+static int imrsim_parse_features(struct dm_target *ti, struct dm_arg_set *as,
+                                 struct imrsim_c *c)
+{
+    static const struct dm_arg _args[] = {
+        {0, 6, "dm-imrsim: error: invalid number of feature arguments"},
+        {1, IMR_JOURNAL_CHECKPOINT, "dm-imrsim: error: invalid max_stale"},
+        {1, IMR_JOURNAL_PAGES * IMR_JOURNAL_RECS / 2, "dm-imrsim: error: invalid min_batch"},
+    };
+    unsigned int argc;
+    const char *arg;
+
+    c->rmw_durability = IMR_RMW_DURABLE_FUA;
+    c->map_mode = IMR_MAP_BLOCK;
+    c->ptask.max_stale = IMR_PSTORE_STALE;
+    c->ptask.min_batch = IMR_PSTORE_BATCH;
+    if(!as->argc){
+        return 0;
+    }
+    if(dm_read_arg_group(_args, as, &argc, &ti->error)){
+        return -EINVAL;
+    }
+    while(argc--){
+        arg = dm_shift_arg(as);
+        if(!strcasecmp(arg, "rmw_fua")){
+            c->rmw_durability = IMR_RMW_DURABLE_FUA;
+        }else if(!strcasecmp(arg, "rmw_flush")){
+            c->rmw_durability = IMR_RMW_DURABLE_FLUSH;
+        }else if(!strcasecmp(arg, "map_block")){
+            c->map_mode = IMR_MAP_BLOCK;
+        }else if(!strcasecmp(arg, "map_extent")){
+            c->map_mode = IMR_MAP_EXTENT;
+        }else if(!strcasecmp(arg, "max_stale") && argc){
+            argc--;
+            if(dm_read_arg(&_args[1], as, &c->ptask.max_stale, &ti->error)){
+                return -EINVAL;
+            }
+        }else if(!strcasecmp(arg, "min_batch") && argc){
+            argc--;
+            if(dm_read_arg(&_args[2], as, &c->ptask.min_batch, &ti->error)){
+                return -EINVAL;
+            }
+        }else{
+            ti->error = "dm-imrsim: error: unknown feature argument";
+            return -EINVAL;
+        }
+    }
+    if(as->argc){
+        ti->error = "dm-imrsim: error: too many arguments";
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* device creation */
+static int imrsim_ctr(struct dm_target *ti,    //创建imrsim_c结构，初始化一些元数据
+                      unsigned int argc,
+                      char **argv)
+{
+    unsigned long long tmp;
+    int iRet;
+    char dummy;
+    struct imrsim_c *c = NULL;
+    struct dm_arg_set as;
+    __u64 num;
+    __u32 i;
+
+    printk(KERN_INFO "imrsim: %s called\n", __FUNCTION__);
+    if(!ti){
+        printk(KERN_ERR "imrsim: error: invalid device\n");
+        return -EINVAL;
+    }
+    if(argc < 2){
+        ti->error = "dm-imrsim: error: invalid argument count; <2";
+        return -EINVAL;
+    }
+    if(1 != sscanf(argv[1], "%llu%c", &tmp, &dummy)){
+        ti->error = "dm-imrsim: error: invalid argument device sector";
+        return -EINVAL;
+    }
+    c = kzalloc(sizeof(*c), GFP_KERNEL);    // To allocate physically contiguous memory.  分配物理上的连续内存。
+    if(!c){
+        ti->error = "dm-imrsim: error: no enough memory";
+        return -ENOMEM;
+    }
+    c->start = tmp;
+    c->zone_size_shift = IMR_ZONE_SIZE_SHIFT_DEFAULT;
+    c->block_size_shift = IMR_BLOCK_SIZE_SHIFT_DEFAULT;
+    as.argc = argc - 2;
+    as.argv = argv + 2;
+    iRet = imrsim_parse_features(ti, &as, c);
+    if(iRet){
+        kfree(c);
+        return iRet;
+    }
+    // Fill in the bdev of the device specified by path and the corresponding interval, permission, mode, etc. into ti->table.
+    iRet = dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &c->dev);
+    if(iRet){
+        ti->error = "dm-imrsim: error: device lookup failed";
+        kfree(c);
+        return iRet;
+    }
+    num = ti->len >> c->block_size_shift >> c->zone_size_shift;
+    if(imrsim_state_size(num) > U32_MAX){
+        printk(KERN_ERR "imrsim: %llu zones exceed the 4GB of state the metadata can hold\n", num);
+        dm_put_device(ti, c->dev);
+        kfree(c);
+        return -EINVAL;
+    }
+    // The metadata follows the last zone on the device, after the sectors the zones take.
+    if((num << c->block_size_shift << c->zone_size_shift) + imrsim_pstore_sectors(num) > bdev_nr_sectors(c->dev->bdev)){
+        ti->error = "dm-imrsim: error: the device has no room for the metadata after the zones";
+        printk(KERN_ERR "imrsim: %llu zones need %llu sectors of metadata after them, the device has %llu sectors\n",
+               num, (__u64)imrsim_pstore_sectors(num), (__u64)bdev_nr_sectors(c->dev->bdev));
+        dm_put_device(ti, c->dev);
+        kfree(c);
+        return -ENOSPC;
+    }
+    if((num << c->block_size_shift << c->zone_size_shift) != ti->len){
+        printk(KERN_ERR "imrsim:error: total size must be zone size (256MB) aligned\n");
+    }
+    if (ti->len < (1 << c->block_size_shift << c->zone_size_shift)) {
+      printk(KERN_INFO "imrsim: capacity: %llu sectors\n", (__u64)ti->len);
+      printk(KERN_ERR "imrsim:error: capacity is too small. The default config is multiple of 256MB\n"); 
+      dm_put_device(ti, c->dev);
+      kfree(c);
+      return -EINVAL;
+   }
+   c->rmw_wq = alloc_workqueue("imrsim_rmw", WQ_MEM_RECLAIM, 0);
+   if(!c->rmw_wq){
+       ti->error = "dm-imrsim: error: cannot create rmw workqueue";
+       goto bad_wq;
+   }
+   // The pools guarantee the RMW and the meta-data I/O progress under memory pressure.
+   if(bioset_init(&c->bio_set, BIO_POOL_SIZE, 0, 0)){
+       ti->error = "dm-imrsim: error: cannot create bio set";
+       goto bad_bio_set;
+   }
+   if(bioset_init(&c->rmw_bio_set, BIO_POOL_SIZE, 0, 0)){
+       ti->error = "dm-imrsim: error: cannot create rmw clone bio set";
+       goto bad_rmw_bio_set;
+   }
+   if(bioset_init(&c->io_bio_set, BIO_POOL_SIZE, 0, BIOSET_NEED_BVECS)){
+       ti->error = "dm-imrsim: error: cannot create rmw bio set";
+       goto bad_io_bio_set;
+   }
+   c->page_pool = mempool_create_page_pool(IMR_PAGE_POOL_SIZE, 0);
+   if(!c->page_pool){
+       ti->error = "dm-imrsim: error: cannot create page pool";
+       goto bad_page_pool;
+   }
+   c->batch_pool = mempool_create_kmalloc_pool(IMR_RMW_BATCH_POOL_SIZE,
+                                                   sizeof(struct imrsim_rmw_batch));
+   if(!c->batch_pool){
+       ti->error = "dm-imrsim: error: cannot create rmw batch pool";
+       goto bad_batch_pool;
+   }
+   if(c->map_mode == IMR_MAP_EXTENT){
+       c->map_buf = kvmalloc(round_up(sizeof(*c->map_buf), PAGE_SIZE), GFP_KERNEL);   // written page by page
+       if(!c->map_buf){
+           ti->error = "dm-imrsim: error: cannot allocate the mapping table buffer";
+           goto bad_map_buf;
+       }
+   }else{
+       // The mapping tables are paged in from the metadata area, dm-bufio bounds the cache.
+       // A holder of a page never waits for another one, a single reserved buffer lets them all go on.
+       c->bufio = dm_bufio_client_create(c->dev->bdev, PAGE_SIZE, 1, 0, NULL, NULL, 0);
+       if(IS_ERR(c->bufio)){
+           ti->error = "dm-imrsim: error: cannot create the mapping table cache";
+           goto bad_map_buf;
+       }
+   }
+   c->journal.pages = vzalloc((IMR_JOURNAL_PAGES + 1) * PAGE_SIZE);
+   if(!c->journal.pages){
+       ti->error = "dm-imrsim: error: cannot allocate the journal";
+       goto bad_journal;
+   }
+   ti->num_flush_bios = ti->num_discard_bios = 1;
+   spin_lock_init(&c->batcher.lock);
+   INIT_LIST_HEAD(&c->batcher.batches);
+   INIT_LIST_HEAD(&c->batcher.writes);
+   spin_lock_init(&c->delayed.lock);
+   bio_list_init(&c->delayed.bios);
+   INIT_WORK(&c->delayed.work, imrsim_delay_work);
+   spin_lock_init(&c->faults.lock);
+   bio_list_init(&c->faults.bios);
+   INIT_WORK(&c->faults.work, imrsim_fault_work);
+   c->ti = ti;
+   ti->per_io_data_size = sizeof(struct imrsim_per_bio);
+   ti->private = c;
+   c->dbg_rerr = c->dbg_werr = c->dbg_log_enabled = 0;
+   init_rwsem(&c->state_lock);
+   for(i = 0; i < IMR_ZONE_LOCK_SHARDS; i++){
+       mutex_init(&c->zone_locks[i]);
+       seqcount_mutex_init(&c->zone_seqs[i], &c->zone_locks[i]);
+   }
+   spin_lock_init(&c->stats_lock);
+   spin_lock_init(&c->ptask.lock);
+   init_waitqueue_head(&c->ptask.wait);
+   spin_lock_init(&c->journal.lock);
+   mutex_init(&c->ioctl_lock);
+   mutex_init(&c->rmw_page_lock);
+   // The metadata is loaded on resume, the target a reload replaces may still write it.
+   return 0;
+
+bad_journal:
+   if(c->bufio){
+       dm_bufio_client_destroy(c->bufio);
+   }
+   kvfree(c->map_buf);
+bad_map_buf:
+   mempool_destroy(c->batch_pool);
+bad_batch_pool:
+   mempool_destroy(c->page_pool);
+bad_page_pool:
+   bioset_exit(&c->io_bio_set);
+bad_io_bio_set:
+   bioset_exit(&c->rmw_bio_set);
+bad_rmw_bio_set:
+   bioset_exit(&c->bio_set);
+bad_bio_set:
+   destroy_workqueue(c->rmw_wq);
+bad_wq:
+   dm_put_device(ti, c->dev);
+   kfree(c);
+   return iRet ? iRet : -ENOMEM;
+}
+
+/*
+ * To load the metadata and start the persistence thread on resume. A reload builds the new
+ * target while the one it replaces still serves I/O, the metadata is read once that one
+ * wrote its last checkpoint in its postsuspend.
+ */
+static int imrsim_preresume(struct dm_target *ti)
+{
+    struct imrsim_c *c = ti->private;
+
+    if(c->ptask.pstore_thread){
+        return 0;
+    }
+    return imrsim_persistence_thread(ti);
+}
+
+/* To stop the persistence thread once the I/O is over, it takes the last checkpoint. */
+static void imrsim_postsuspend(struct dm_target *ti)
+{
+    struct imrsim_c *c = ti->private;
+
+    if(c->ptask.pstore_thread){
+        kthread_stop(c->ptask.pstore_thread);
+        c->ptask.pstore_thread = NULL;
+    }
+}
+
+/* device destory */
+static void imrsim_dtr(struct dm_target *ti)  //释放imrsim_c以及元数据的空间
+{
+    struct imrsim_c *c = (struct imrsim_c *) ti->private;
+    __u32 i;
+
+    if(c->ptask.pstore_thread){
+        kthread_stop(c->ptask.pstore_thread);  // To kill the persistent thread.
+    }
+    destroy_workqueue(c->rmw_wq);          // Wait for the RMWs and delayed bios in flight.
+    bioset_exit(&c->bio_set);
+    bioset_exit(&c->rmw_bio_set);
+    bioset_exit(&c->io_bio_set);
+    mempool_destroy(c->page_pool);
+    mempool_destroy(c->batch_pool);
+    for(i = 0; i < IMR_ZONE_LOCK_SHARDS; i++){
+        mutex_destroy(&c->zone_locks[i]);
+    }
+    mutex_destroy(&c->ioctl_lock);
+    mutex_destroy(&c->rmw_page_lock);
+    imrsim_reset_zone_maps(c, 0);   // writes the cached pages of the mapping tables
+    if(c->bufio){
+        dm_bufio_client_destroy(c->bufio);
+    }
+    dm_put_device(ti, c->dev);
+    kvfree(c->map_buf);
+    vfree(c->journal.pages);
+    vfree(c->zone_state);
+    kvfree(c->shadow);
+    bitmap_free(c->state_dirty);
+    bitmap_free(c->prev_dirty);
+    bitmap_free(c->shadow_dirty);
+    vfree(c->state_crcs);
+    kfree(c);
+    printk(KERN_INFO "imrsim target destructed\n");
+}
+
+/*
+ * To look a block or a PBA of a zone up, -1 if it has no mapping and -EIO if its page of
+ * the mapping table cannot be read. rev looks the owner of a PBA up. Runs under the zone
+ * lock or inside the seqcount of a read.
+ */
+static int imrsim_lookup(struct imrsim_c *c, __u32 zone_idx, __u32 index, int rev)
+{
+    struct imrsim_zone_extents *ze;
+    struct dm_buffer *bp;
+    unsigned long *bits;
+    __u16 *entry;
+    bool mapped;
+    int ret = -1;
+
+    if(c->map_mode == IMR_MAP_EXTENT){
+        ze = smp_load_acquire(&c->zone_extents[zone_idx]);
+        if(ze){
+            rcu_read_lock();
+            ret = imrsim_extent_lookup(rev ? rcu_dereference(ze->rev) : rcu_dereference(ze->fwd), index);
+            rcu_read_unlock();
+        }
+        return ret;
+    }
+    if(!READ_ONCE(c->zone_status[zone_idx].z_map_size)){
+        return -1;   // the slot is not cleared yet
+    }
+    // one page of the cache is held at a time, a holder never waits for another one
+    bits = imrsim_slot_get(c, zone_idx, (rev ? offsetof(struct imrsim_zone_map, used) :
+                           offsetof(struct imrsim_zone_map, mapped)) + BIT_WORD(index) * sizeof(long), &bp);
+    if(!bits){
+        return -EIO;
+    }
+    mapped = test_bit(index % BITS_PER_LONG, bits);
+    dm_bufio_release(bp);
+    if(!mapped){
+        return -1;
+    }
+    entry = imrsim_slot_get(c, zone_idx, (rev ? offsetof(struct imrsim_zone_map, lba) :
+                            offsetof(struct imrsim_zone_map, pba)) + index * sizeof(__u16), &bp);
+    if(!entry){
+        return -EIO;
+    }
+    ret = READ_ONCE(*entry);
+    dm_bufio_release(bp);
+    return ret;
+}
+
+/* To get the block owning a PBA of a zone, -1 if the PBA is free. */
+static int imrsim_pba_owner(struct imrsim_c *c, __u32 zone_idx, __u32 pba)
+{
+    return imrsim_lookup(c, zone_idx, pba, 1);
+}
+
+/* To set or clear bit nr of the bitmap at off in the slot of a zone, its page is the only one held. */
+static int imrsim_slot_assign_bit(struct imrsim_c *c, __u32 zone_idx, size_t off, __u32 nr, bool set)
+{
+    struct dm_buffer *bp;
+    unsigned long *word = imrsim_slot_get(c, zone_idx, off + BIT_WORD(nr) * sizeof(long), &bp);
+
+    if(!word){
+        return -EIO;
+    }
+    write_seqcount_begin(imrsim_zone_seq(c, zone_idx));
+    if(set){
+        set_bit(nr % BITS_PER_LONG, word);
+    }else{
+        clear_bit(nr % BITS_PER_LONG, word);
+    }
+    write_seqcount_end(imrsim_zone_seq(c, zone_idx));
+    dm_bufio_mark_buffer_dirty(bp);
+    dm_bufio_release(bp);
+    return 0;
+}
+
+/* To set entry nr of the array at off in the slot of a zone, its page is the only one held. */
+static int imrsim_slot_set_entry(struct imrsim_c *c, __u32 zone_idx, size_t off, __u32 nr, __u16 val)
+{
+    struct dm_buffer *bp;
+    __u16 *entry = imrsim_slot_get(c, zone_idx, off + nr * sizeof(__u16), &bp);
+
+    if(!entry){
+        return -EIO;
+    }
+    write_seqcount_begin(imrsim_zone_seq(c, zone_idx));
+    WRITE_ONCE(*entry, val);
+    write_seqcount_end(imrsim_zone_seq(c, zone_idx));
+    dm_bufio_mark_buffer_dirty(bp);
+    dm_bufio_release(bp);
+    return 0;
+}
+
+/*
+ * To map a block of a zone to a PBA in its slot, a page at a time so that the holders of
+ * the zone locks never wait for each other's pages of the cache. The PBA is owned before
+ * the block points to it, and the pba before the mapped bit, so that a lockless read finds
+ * the old PBA or the new one. A slot which cannot be read may keep the new PBA owned by a
+ * block it is not mapped to, the allocation skips it and the load drops it.
+ */
+static int imrsim_slot_map_block(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset,
+                                 __u32 pba, int old)
+{
+    int ret;
+
+    ret = imrsim_slot_set_entry(c, zone_idx, offsetof(struct imrsim_zone_map, lba), pba, block_offset);
+    if(!ret){
+        ret = imrsim_slot_assign_bit(c, zone_idx, offsetof(struct imrsim_zone_map, used), pba, true);
+    }
+    if(!ret){
+        ret = imrsim_slot_set_entry(c, zone_idx, offsetof(struct imrsim_zone_map, pba), block_offset, pba);
+    }
+    if(!ret){
+        ret = imrsim_slot_assign_bit(c, zone_idx, offsetof(struct imrsim_zone_map, mapped), block_offset, true);
+    }
+    if(!ret && old >= 0){
+        ret = imrsim_slot_assign_bit(c, zone_idx, offsetof(struct imrsim_zone_map, used), old, false);
     }
-    mutex_unlock(&imrsim_zone_lock);
-    return 0;
+    return ret;
 }
-EXPORT_SYMBOL(imrsim_blkdev_reset_zone_ptr);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
 
-/* error log */
-void imrsim_log_error(struct bio* bio, __u32 uerr)
+/*
+ * To map a block of a zone to a PBA, the PBA it had before is freed and the reverse
+ * map follows. The caller holds the zone lock and the zone has its mapping table.
+ * Nothing changes when the extents cannot grow, see imrsim_slot_map_block() for a slot
+ * which cannot be read.
+ */
+static int imrsim_map_block(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset, __u32 pba)
 {
-    __u64 lba;
+    struct imrsim_zone_extents *ze;
+    int old = imrsim_lookup(c, zone_idx, block_offset, 0);
 
-    if (!bio) {
-        printk(KERN_ERR "imrsim: NULL pointer passed through\n");
-        return;
+    if(old < -1){
+        return old;
     }
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-    lba = bio->bi_sector;
-    #else
-    lba = bio->bi_iter.bi_sector;
-    #endif
-    if (imrsim_dbg_log_enabled) {
-        switch(uerr)
-        {
-            case IMR_ERR_READ_BORDER:
-                printk(KERN_DEBUG "%s: lba:%llu IMR_ERR_READ_BORDER\n", __FUNCTION__, lba);
-                imrsim_dbg_rerr = uerr;
-                break;
-            case IMR_ERR_READ_POINTER: 
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_READ_POINTER\n",__FUNCTION__, lba);
-                imrsim_dbg_rerr = uerr;
-                break;
-            case IMR_ERR_WRITE_RO:
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_RO\n", __FUNCTION__, lba);
-                imrsim_dbg_werr = uerr;
-                break;
-            case IMR_ERR_WRITE_POINTER :
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_POINTER\n",__FUNCTION__, lba);
-                imrsim_dbg_werr = uerr;
-                break;
-            case IMR_ERR_WRITE_ALIGN :
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_ALIGN\n", __FUNCTION__, lba);
-                imrsim_dbg_werr = uerr;
-                break;
-            case IMR_ERR_WRITE_BORDER:
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_BORDER\n", __FUNCTION__, lba);
-                imrsim_dbg_werr = uerr;
-                break;
-            case IMR_ERR_WRITE_FULL:
-                printk(KERN_DEBUG "%s: lba:%llu: IMR_ERR_WRITE_FULL\n", __FUNCTION__, lba);
-                imrsim_dbg_werr = uerr;
-                break;
-            default:
-                printk(KERN_DEBUG "%s: lba:%llu: UNKNOWN ERR=%u\n", __FUNCTION__, lba, uerr);
+    if(c->map_mode == IMR_MAP_EXTENT){
+        ze = c->zone_extents[zone_idx];
+        if(imrsim_extents_reserve(&ze->fwd) || imrsim_extents_reserve(&ze->rev)){
+            return -ENOMEM;
         }
+        write_seqcount_begin(imrsim_zone_seq(c, zone_idx));
+        if(old != -1){
+            imrsim_extent_erase(rcu_dereference_protected(ze->fwd, true), block_offset);
+            imrsim_extent_erase(rcu_dereference_protected(ze->rev, true), old);
+        }
+        imrsim_extent_insert(rcu_dereference_protected(ze->fwd, true), block_offset, pba);
+        imrsim_extent_insert(rcu_dereference_protected(ze->rev, true), pba, block_offset);
+        write_seqcount_end(imrsim_zone_seq(c, zone_idx));
+        set_bit(zone_idx, c->maps_dirty);
+        return 0;
     }
+    return imrsim_slot_map_block(c, zone_idx, block_offset, pba, old);
 }
 
-/* The following is the relevant method to build the target_type structure. */
-/* device creation */
-static int imrsim_ctr(struct dm_target *ti,    //创建imrsim_c结构，初始化一些元数据
-                      unsigned int argc,
-                      char **argv)
+/* To get the PBA at index idx of the allocation order of a zone, phase gets its stage. */
+static __u32 imrsim_alloc_order_pba(__u32 idx, __u32 *phase)
 {
-    unsigned long long tmp;
-    int iRet;
-    char dummy;
-    struct imrsim_c *c = NULL;
-    __u64 num;
-
-    printk(KERN_INFO "imrsim: %s called\n", __FUNCTION__);
-    if(imrsim_single){
-        printk(KERN_ERR "imrsim: No multiple device support currently\n");
-        return -EINVAL;
+    __u32 boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
+    __u32 relocateTrackno;   // In a stage allocation, how many tracks are the relocated lba on?
+
+    // Note: Multiply TOP_TRACK_NUM_TOTAL because the number of top and bottom tracks in the zone is equal
+    if(idx < boundary){
+        // first stage allocation, the bottom tracks
+        relocateTrackno = idx / IMR_BOTTOM_TRACK_SIZE;
+        *phase = 1;
+        return (relocateTrackno+1)*IMR_TOP_TRACK_SIZE + relocateTrackno*IMR_BOTTOM_TRACK_SIZE
+             + idx % IMR_BOTTOM_TRACK_SIZE;
     }
-    if(!ti){
-        printk(KERN_ERR "imrsim: error: invalid device\n");
-        return -EINVAL;
+    if(IMR_ALLOCATION_PHASE == 2){
+        // second stage allocation, the top tracks in order
+        relocateTrackno = (idx - boundary) / IMR_TOP_TRACK_SIZE;
+        *phase = 2;
+        return relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)
+             + (idx - boundary) % IMR_TOP_TRACK_SIZE;
     }
-    if(2 != argc){
-        ti->error = "dm-imrsim: error: invalid argument count; !=2";
-        return -EINVAL;
+    if(idx < boundary + IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2){
+        // In second stage allocation Top(0,2,4,...)
+        relocateTrackno = 2*((idx - boundary) / IMR_TOP_TRACK_SIZE);
+        *phase = 2;
+        return relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)
+             + (idx - boundary) % IMR_TOP_TRACK_SIZE;
     }
-    if(1 != sscanf(argv[1], "%llu%c", &tmp, &dummy)){
-        ti->error = "dm-imrsim: error: invalid argument device sector";
-        return -EINVAL;
+    // In the third stage allocation Top(1,3,5,...)
+    relocateTrackno = 2*((idx - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2)
+                    / IMR_TOP_TRACK_SIZE) + 1;
+    *phase = 3;
+    return relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)
+         + (idx - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2) % IMR_TOP_TRACK_SIZE;
+}
+
+/* To get the index of a PBA in the allocation order of a zone, the inverse of imrsim_alloc_order_pba(). */
+static __u32 imrsim_pba_alloc_index(__u32 pba)
+{
+    __u32 boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
+    __u32 trackno = pba / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);
+    __u32 blockno = pba % (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);
+
+    if(blockno >= IMR_TOP_TRACK_SIZE){
+        return trackno * IMR_BOTTOM_TRACK_SIZE + blockno - IMR_TOP_TRACK_SIZE;
     }
-    c = kmalloc(sizeof(*c), GFP_KERNEL);    // To allocate physically contiguous memory.  分配物理上的连续内存。
-    if(!c){
-        ti->error = "dm-imrsim: error: no enough memory";
-        return -ENOMEM;
+    if(IMR_ALLOCATION_PHASE == 2){
+        return boundary + trackno * IMR_TOP_TRACK_SIZE + blockno;
     }
-    c->start = tmp;
-    // Fill in the bdev of the device specified by path and the corresponding interval, permission, mode, etc. into ti->table.
-    iRet = dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &c->dev);
-    if(iRet){
-        ti->error = "dm-imrsim: error: device lookup failed";
-        kfree(c);
-        return iRet;
+    return boundary + (trackno % 2) * (IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2)
+         + (trackno / 2) * IMR_TOP_TRACK_SIZE + blockno;
+}
+
+/*
+ * To allocate the next PBA of a zone according to the phase, returns its block offset in
+ * the zone, IMR_NO_PBA if the mapping table could not grow. A PBA some block owns already
+ * is skipped, its data is never written over.
+ */
+static __u32 imrsim_alloc_pba(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset)
+{
+    __u32 mapSize = c->zone_status[zone_idx].z_map_size;
+    __u32 pba;
+    __u32 phase;
+    int owner;
+
+    for(;; mapSize++){
+        if(mapSize >= IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL + IMR_TOP_TRACK_SIZE * TOP_TRACK_NUM_TOTAL){
+            return IMR_NO_PBA;
+        }
+        pba = imrsim_alloc_order_pba(mapSize, &phase);
+        owner = imrsim_pba_owner(c, zone_idx, pba);
+        if(owner == -1){
+            break;
+        }
+        if(owner < -1){
+            return IMR_NO_PBA;
+        }
+        if(printk_ratelimit()){
+            printk(KERN_ERR "imrsim: error: pba %u of zone %u is already owned by block %d, skipped\n",
+                   pba, zone_idx, owner);
+        }
     }
-    if(ti->len > IMR_MAX_CAPACITY){
-        printk(KERN_ERR "imrsim: capacity %llu exceeds the maximum 10TB\n", (__u64)ti->len);
-        kfree(c);
-        return -EINVAL;
+    trace_imrsim_alloc(zone_idx, block_offset, pba, phase, mapSize);
+    if(imrsim_map_block(c, zone_idx, block_offset, pba)){
+        return IMR_NO_PBA;
     }
-    num = ti->len >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;
-    if((num << IMR_BLOCK_SIZE_SHIFT << IMR_ZONE_SIZE_SHIFT) != ti->len){
-        printk(KERN_ERR "imrsim:error: total size must be zone size (256MB) aligned\n");
+    c->zone_status[zone_idx].z_map_size = mapSize + 1;
+    imrsim_state_dirty(c, &c->zone_status[zone_idx], sizeof(struct imrsim_zone_status));
+    imrsim_journal_add(c, zone_idx, block_offset, pba);
+    return pba;
+}
+
+/* To get the PBA a block of a write goes to, a new block is allocated. The zone has its mapping table. */
+static __u32 imrsim_write_pba(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset)
+{
+    int pba;
+
+    if(IMR_ALLOCATION_PHASE == 1){
+        return block_offset;
     }
-    if (ti->len < (1 << IMR_BLOCK_SIZE_SHIFT << IMR_ZONE_SIZE_SHIFT)) {
-      printk(KERN_INFO "imrsim: capacity: %llu sectors\n", (__u64)ti->len);
-      printk(KERN_ERR "imrsim:error: capacity is too small. The default config is multiple of 256MB\n"); 
-      kfree(c);
-      return -EINVAL;
-   }
-   ti->num_flush_bios = ti->num_discard_bios = ti->num_write_same_bios = 1;
-   ti->private = c;
-   imrsim_dbg_rerr = imrsim_dbg_werr = imrsim_dbg_log_enabled = 0;
-   mutex_init(&imrsim_zone_lock);
-   mutex_init(&imrsim_ioctl_lock);
-   // To open a persistent thread.
-   if(imrsim_persistence_thread(ti)){
-       printk(KERN_ERR "imrsim: error: metadata will not be persisted\n");
-   }
-   imrsim_single = 1;
-   return 0;
+    pba = imrsim_lookup(c, zone_idx, block_offset, 0);
+    if(pba == -1){   // a new write operation
+        return imrsim_alloc_pba(c, zone_idx, block_offset);
+    }
+    if(pba < 0){
+        return IMR_NO_PBA;
+    }
+    // lba is in the mapping table, indicating an update operation
+    trace_imrsim_lba_to_pba(zone_idx, block_offset, pba, 1);
+    return pba;
 }
 
-/* device destory */
-static void imrsim_dtr(struct dm_target *ti)  //释放imrsim_c以及元数据的空间
+/* To get the bitmap of the used blocks of a top track. */
+static unsigned long *imrsim_top_used(struct imrsim_c *c, __u32 zone_idx, __u32 trackno)
 {
-    struct imrsim_c *c = (struct imrsim_c *) ti->private;
+    return (unsigned long *)c->zone_tracks[(size_t)zone_idx * TOP_TRACK_NUM_TOTAL + trackno].isUsedBlock;
+}
 
-    kthread_stop(imrsim_ptask.pstore_thread);  // To kill the persistent thread.
-    mutex_destroy(&imrsim_zone_lock);
-    mutex_destroy(&imrsim_ioctl_lock);
-    dm_put_device(ti, c->dev);
-    kfree(c);
-    vfree(zone_state);
-    imrsim_single = 0;
-    printk(KERN_INFO "imrsim target destructed\n");
+/* Track ratio, no floating point in the kernel. */
+static __u32 imrsim_track_rate(void)
+{
+    return IMR_BOTTOM_TRACK_SIZE * 10000 / IMR_TOP_TRACK_SIZE;
+}
+
+/* To get the top-track block a bottom-track block overlaps. */
+static __u32 imrsim_bottom_to_top(__u32 blockno)
+{
+    return blockno * 10000 / imrsim_track_rate();
+}
+
+/* To get the first bottom-track block overlapping a top-track block or a later one. */
+static __u32 imrsim_top_to_bottom(__u32 topno)
+{
+    return DIV_ROUND_UP(topno * imrsim_track_rate(), 10000);
+}
+
+/*
+ * To find the used top-track blocks the bottom-track blocks first..last overlap, a word
+ * at a time. Unless top is NULL they are put in top[0] for track trackno and top[1] for
+ * trackno+1. Returns the offset of the first of them, TOP_TRACK_SIZE if there is none.
+ */
+static __u32 imrsim_bottom_wa(struct imrsim_c *c, __u32 zone_idx, __u32 trackno,
+                              __u32 first, __u32 last, unsigned long (*top)[BITS_TO_LONGS(TOP_TRACK_SIZE)])
+{
+    DECLARE_BITMAP(range, TOP_TRACK_SIZE);
+    __u32 lo = imrsim_bottom_to_top(first);
+    __u32 hi = imrsim_bottom_to_top(last) + 1;
+    __u32 topno = TOP_TRACK_SIZE;
+    __u8 k;
+
+    for(k = 0; k < 2 && trackno + k < TOP_TRACK_NUM_TOTAL; k++){   //trackno号磁道有数据
+        topno = min_t(__u32, topno, find_next_bit(imrsim_top_used(c, zone_idx, trackno + k), hi, lo));
+    }
+    if(topno >= hi){
+        return TOP_TRACK_SIZE;
+    }
+    if(top){
+        bitmap_zero(range, TOP_TRACK_SIZE);
+        bitmap_set(range, lo, hi - lo);
+        for(k = 0; k < 2; k++){
+            if(trackno + k < TOP_TRACK_NUM_TOTAL){
+                bitmap_and(top[k], imrsim_top_used(c, zone_idx, trackno + k), range, TOP_TRACK_SIZE);
+            }else{
+                bitmap_zero(top[k], TOP_TRACK_SIZE);
+            }
+        }
+    }
+    return topno;
 }
 
-/* Device Write Rules */
-int imrsim_write_rule_check(struct bio *bio, __u32 zone_idx,
-                            sector_t bio_sectors, int policy_flag)
+/*
+ * Device Write Rules, the caller holds the lock of zone_idx.
+ * Every block of the bio is mapped, the bio is cut with dm_accept_partial_bio()
+ * where the PBAs stop being contiguous and at the end of the zone. A part which
+ * needs a RMW holds only bottom-track blocks of one track group, their used
+ * neighbors are put in rmw. The accepted part holds at most one top-track run,
+ * put in top. Returns 1 if the accepted part needs a RMW.
+ */
+int imrsim_write_rule_check(struct imrsim_c *c, struct bio *bio, __u32 zone_idx,
+                            sector_t bio_sectors, int policy_flag,
+                            struct imrsim_rmw_task *rmw, struct imrsim_top_write *top)
 {
     __u64  lba;
-    __u64  lba_offset;    // The offset of lba in the zone
-    __u64  block_offset;  // The offset of the block in the zone
-    __u64  boundary;
-    __u64  elba;
     __u64  zlba;          //zone的起始地址
-    __u32  relocateTrackno;   // In a stage allocation, how many tracks are the relocated lba on?
+    __u64  lba_offset;    // The offset of lba in the zone
+    __u32  block_offset;  // The offset of the block in the zone
+    __u32  sector_offset; // The offset of lba in its block
+    __u32  nr_blocks;
+    __u32  pba;           // The first PBA of the run
+    __u32  next;
+    __u32  n;
     __u32  rv;       // rule violation  违反规则
-    __u32  z_size;
     __u32  trackno;  // on the top-bottom track group  lba在当前zone的第几号磁道组trackno
     __u32  blockno;  // The number of the block corresponding to lba on the track
-    __u32  trackrate;  // Track ratio, p.s. linux kernel does not support floating point calculation.
-    __u16  wa_penalty;  //写放大惩罚?延迟
-    __u8   isTopTrack;
-    __u8   rewriteSign;   //重写标志？
-    __u8   ret=1;       // Determine whether the block requested by lba is in the mapping table.
-                        //判断lba请求的block是否在映射表中。
-
-    zlba = zone_idx_lba(zone_idx);
+    __u32  topno;
+    __u32  first;    // The first bottom-track block needing a RMW
+    __u32  end;
+    __u32  m;        // The blocks of the run on the current track
+    sector_t accepted;
+    __u8   k;
+    __u8   remap;
+    __u8   stop;
+
+    zlba = zone_idx_lba(c, zone_idx);
+    lba = bio->bi_iter.bi_sector;
+    lba_offset = lba - zlba;
+    block_offset = lba_offset >> c->block_size_shift;
+    sector_offset = lba_offset & ((1 << c->block_size_shift) - 1);
+    nr_blocks = (sector_offset + bio_sectors + (1 << c->block_size_shift) - 1) >> c->block_size_shift;
+    if(block_offset + nr_blocks > (1 << c->zone_size_shift)){   // cut at the end of the zone
+        nr_blocks = (1 << c->zone_size_shift) - block_offset;
+    }
+    remap = bio->bi_private != &c->completion.write_event;
 
-    /* Relocate bio according to phase. */
-    if(bio->bi_private != &imrsim_completion.write_event)
-    {
-        /* 根据phase来重定位bio */
-        #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-        switch(IMR_ALLOCATION_PHASE)
-        {
-            case 1:
-				lba = bio->bi_sector;
-				break;
-			case 2:
-				lba = bio->bi_sector;
-				//printk(KERN_INFO "imrsim: request- lba(sectors) is %llu\n", lba);
-				lba_offset = bio->bi_sector - zlba;
-				block_offset = lba_offset >> IMR_BLOCK_SIZE_SHIFT;
-				//Check the mapping table, ret indicates whether the block where lba is located is in the mapping table
-				ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;
-				if(!ret){         // lba is not in the mapping table, indicating a new write operation
-					// Fill the mapping table, allocate tracks according to the stage, and write data
-					// Note: Multiply TOP_TRACK_NUM_TOTAL because the number of top and bottom tracks in the zone is equal
-					boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
-					if(zone_status[zone_idx].z_map_size < boundary){
-						// Indicates that the relocated lba should be on the bottom track, in the first stage allocation
-						isTopTrack = 0;
-						// Judgment should be redirected to the first few bottom tracks
-						relocateTrackno = zone_status[zone_idx].z_map_size / IMR_BOTTOM_TRACK_SIZE;
-						// Get the pba corresponding to the bio starting lba
-						bio->bi_sector = zlba  
-							+ (((relocateTrackno+1)*(IMR_TOP_TRACK_SIZE)+relocateTrackno*IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT) 
-							+ ((zone_status[zone_idx].z_map_size % IMR_BOTTOM_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-						printk(KERN_INFO "imrsim: write_ops(bottom) on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-						zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-						zone_status[zone_idx].z_map_size++;
-						lba = bio->bi_sector;
-					}else{
-						// Indicates that the relocated lba should be on the top track, in a second stage allocation
-						isTopTrack = 1;
-						relocateTrackno = (zone_status[zone_idx].z_map_size - boundary) / IMR_TOP_TRACK_SIZE;
-						bio->bi_sector = zlba
-							+ (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-							+ (((zone_status[zone_idx].z_map_size - boundary) % IMR_TOP_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT);
-						printk(KERN_INFO "imrsim: write_ops(top) on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-						zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-						zone_status[zone_idx].z_map_size++;
-						lba = bio->bi_sector;
-					}
-				}else{            // lba is in the mapping table, indicating an update operation
-					// Get pba from the mapping table, modify lba in bio
-					bio->bi_sector = zlba + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT);
-					printk(KERN_INFO "imrsim: update_ops on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-					lba = bio->bi_sector;
-				}
-				break;
-			case 3:
-				lba = bio->bi_sector;
-				lba_offset = bio->bi_sector - zlba;
-				block_offset = lba_offset >> IMR_BLOCK_SIZE_SHIFT;
-				ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;
-				if(!ret){         // a new write operation
-					boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
-					__u32 mapSize = zone_status[zone_idx].z_map_size;
-					if(mapSize < boundary){
-						// first stage allocation
-						isTopTrack = 0;
-						relocateTrackno = mapSize / IMR_BOTTOM_TRACK_SIZE;
-						bio->bi_sector = zlba  
-							+ (((relocateTrackno+1)*(IMR_TOP_TRACK_SIZE)+relocateTrackno*IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT) 
-							+ ((mapSize % IMR_BOTTOM_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-						printk(KERN_INFO "imrsim: write_ops_3(bottom) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-						zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-						zone_status[zone_idx].z_map_size++;
-						lba = bio->bi_sector;
-					}else if(mapSize >= boundary 
-						&& mapSize < boundary + IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2){
-						// In second stage allocation Top(0,2,4,...)
-						isTopTrack = 1;
-						relocateTrackno = 2*((mapSize - boundary) / IMR_TOP_TRACK_SIZE);
-						bio->bi_sector = zlba
-							+ (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-							+ (((mapSize - boundary) % IMR_TOP_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-						printk(KERN_INFO "imrsim: write_ops_3(top_1) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-						zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-						zone_status[zone_idx].z_map_size++;
-						lba = bio->bi_sector;
-					}else{
-						// In the third stage allocation Top(1,3,5,...)
-						isTopTrack = 1;
-						relocateTrackno = 2*((mapSize - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2) 
-										/ IMR_TOP_TRACK_SIZE) + 1;
-						bio->bi_sector = zlba
-							+ (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-							+ (((mapSize - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2) % IMR_TOP_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT);
-						printk(KERN_INFO "imrsim: write_ops_3(top_2) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector);
-						zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-						zone_status[zone_idx].z_map_size++;
-						lba = bio->bi_sector;
-					}
-				}else{            // an update operation
-					bio->bi_sector = zlba + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT);
-					printk(KERN_INFO "imrsim: update_ops - start lba is %llu, pba is %llu\n", lba, bio->bi_sector);
-					lba = bio->bi_sector;
-				}
-				break;
-			default:
-				printk(KERN_ERR "imrsim: error: Allocation of more phases is not currently supported!\n");
-        }
-        #else
-        switch(IMR_ALLOCATION_PHASE)
-        {
-            case 1:
-                lba = bio->bi_iter.bi_sector;
-                break;
-            case 2:
-                lba = bio->bi_iter.bi_sector;
-                //printk(KERN_INFO "imrsim: request- lba(sectors) is %llu\n", lba);
-                lba_offset = bio->bi_iter.bi_sector - zlba;
-                block_offset = lba_offset >> IMR_BLOCK_SIZE_SHIFT;
-                //Check the mapping table, ret indicates whether the block where lba is located is in the mapping table
-                ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;
-                if(!ret){          // lba is not in the mapping table, indicating a new write operation
-                    // Fill the mapping table, allocate tracks according to the stage, and write data
-					// Note: Multiply TOP_TRACK_NUM_TOTAL because the number of top and bottom tracks in the zone is equal
-                    boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
-                    if(zone_status[zone_idx].z_map_size < boundary){
-                        // Indicates that the relocated lba should be on the bottom track, in the first stage allocation
-                        isTopTrack = 0;
-                        // Judgment should be redirected to the first few bottom tracks
-                        relocateTrackno = zone_status[zone_idx].z_map_size / IMR_BOTTOM_TRACK_SIZE;
-                        // Get the pba corresponding to the bio starting lba
-                        bio->bi_iter.bi_sector = zlba  
-                            + (((relocateTrackno+1)*(IMR_TOP_TRACK_SIZE)+relocateTrackno*IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT) 
-                            + ((zone_status[zone_idx].z_map_size % IMR_BOTTOM_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-                        printk(KERN_INFO "imrsim: write_ops(bottom) on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-                        zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_iter.bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-                        zone_status[zone_idx].z_map_size++;
-                        lba = bio->bi_iter.bi_sector;
-                    }else{
-                        // Indicates that the relocated lba should be on the top track, in a second stage allocation
-                        isTopTrack = 1;
-                        relocateTrackno = (zone_status[zone_idx].z_map_size - boundary) / IMR_TOP_TRACK_SIZE;
-                        bio->bi_iter.bi_sector = zlba
-                            + (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-                            + (((zone_status[zone_idx].z_map_size - boundary) % IMR_TOP_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT);
-                        printk(KERN_INFO "imrsim: write_ops(top) on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-                        zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_iter.bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-                        zone_status[zone_idx].z_map_size++;
-                        lba = bio->bi_iter.bi_sector;
-                    }
-                }else{            // lba is in the mapping table, indicating an update operation
-                    // Get pba from the mapping table, modify lba in bio
-                    bio->bi_iter.bi_sector = zlba + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT);
-                    printk(KERN_INFO "imrsim: update_ops on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-                    lba = bio->bi_iter.bi_sector;
-                }
+    /* Map the first block, then extend the run while the PBAs follow it, a track at a time. 根据phase来重定位bio */
+    pba = remap ? imrsim_write_pba(c, zone_idx, block_offset) : block_offset;
+    if(pba == IMR_NO_PBA){
+        return -EIO;   // a later block without PBA only ends the run
+    }
+    rmw->nr_top = 0;
+    stop = 0;
+    for(n = 0; n < nr_blocks && !stop; n += m){
+        next = n ? (remap ? imrsim_write_pba(c, zone_idx, block_offset + n) : block_offset + n) : pba;
+        if(next != pba + n){
+            break;
+        }
+        trackno = next / (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);   //lba在当前zone的第几号磁道组trackno
+        blockno = next % (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE);
+        // The RMW writes its backup back after the bio, it must not cover a top-track block of the bio.
+        if(rmw->nr_top && (blockno < IMR_TOP_TRACK_SIZE || trackno != rmw->trackno)){
+            break;
+        }
+        // The blocks of the run on this track
+        end = blockno < IMR_TOP_TRACK_SIZE ? IMR_TOP_TRACK_SIZE : IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE;
+        for(m = 1; n + m < nr_blocks && blockno + m < end; m++){
+            if((remap ? imrsim_write_pba(c, zone_idx, block_offset + n + m) : block_offset + n + m) != next + m){
+                stop = 1;
                 break;
-            case 3:
-                lba = bio->bi_iter.bi_sector;
-                lba_offset = bio->bi_iter.bi_sector - zlba;
-                block_offset = lba_offset >> IMR_BLOCK_SIZE_SHIFT;
-                ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;  //判断lba请求的block是否在映射表中。
-                if(!ret){         // a new write operation
-                    // 填充映射表，按照阶段情况分配磁道，写入数据
-                    boundary = IMR_BOTTOM_TRACK_SIZE * TOP_TRACK_NUM_TOTAL;
-                    __u32 mapSize = zone_status[zone_idx].z_map_size;
-                    if(mapSize < boundary){
-                        // first stage allocation
-                        isTopTrack = 0;
-                        // Judgment should be redirected to the first few bottom tracks
-                        relocateTrackno = mapSize / IMR_BOTTOM_TRACK_SIZE;
-                        // Get the pba corresponding to the bio starting lba
-                        bio->bi_iter.bi_sector = zlba  
-                            + (((relocateTrackno+1)*(IMR_TOP_TRACK_SIZE)+relocateTrackno*IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT) 
-                            + ((mapSize % IMR_BOTTOM_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-                        printk(KERN_INFO "imrsim: write_ops_3(bottom) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-                        zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_iter.bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-                        zone_status[zone_idx].z_map_size++;
-                        lba = bio->bi_iter.bi_sector;
-                    }else if(mapSize >= boundary 
-                        && mapSize < boundary + IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2){
-                        // In second stage allocation Top(0,2,4,...)
-                        isTopTrack = 1;
-                        relocateTrackno = 2*((mapSize - boundary) / IMR_TOP_TRACK_SIZE);
-                        bio->bi_iter.bi_sector = zlba
-                            + (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-                            + (((mapSize - boundary) % IMR_TOP_TRACK_SIZE) << IMR_BLOCK_SIZE_SHIFT);
-                        printk(KERN_INFO "imrsim: write_ops_3(top_1) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT);
-                        zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_iter.bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-                        zone_status[zone_idx].z_map_size++;
-                        lba = bio->bi_iter.bi_sector;
-                    }else{
-                        // In the third stage allocation Top(1,3,5,...)
-                        isTopTrack = 1;
-                        relocateTrackno = 2*((mapSize - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2) 
-                                        / IMR_TOP_TRACK_SIZE) + 1;
-                        bio->bi_iter.bi_sector = zlba
-                            + (relocateTrackno*(IMR_TOP_TRACK_SIZE+IMR_BOTTOM_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT)
-                            + (((mapSize - boundary - IMR_TOP_TRACK_SIZE*TOP_TRACK_NUM_TOTAL/2) % IMR_TOP_TRACK_SIZE)<<IMR_BLOCK_SIZE_SHIFT);
-                        printk(KERN_INFO "imrsim: write_ops_3(top_2) - start LBA is %llu, PBA is %llu\n", lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector);
-                        zone_status[zone_idx].z_pba_map[block_offset] = (bio->bi_iter.bi_sector - zlba) >> IMR_BLOCK_SIZE_SHIFT;
-                        zone_status[zone_idx].z_map_size++;
-                        lba = bio->bi_iter.bi_sector;
-                    }
-                }else{            // an update operation
-                    bio->bi_iter.bi_sector = zlba + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT);
-                    printk(KERN_INFO "imrsim: update_ops - start lba is %llu, pba is %llu\n", lba, bio->bi_iter.bi_sector);
-                    lba = bio->bi_iter.bi_sector;
+            }
+        }
+        // If lba is on the top track, mark the top track with data, and on the bottom track, determine whether to rewrite
+        //如果lba(实际是pba)在top track上，则在top track上标记data，在bottom track上，判断是否rewrite
+        if(blockno < IMR_TOP_TRACK_SIZE){
+            if(top->nr){
+                break;   // a RMW waits for the writes of its blocks, one run each
+            }
+            top->zone_idx = zone_idx;
+            top->trackno = trackno;
+            top->first = blockno;
+            top->nr = m;
+            bitmap_set(imrsim_top_used(c, zone_idx, trackno), blockno, m);
+            imrsim_state_dirty(c, imrsim_top_used(c, zone_idx, trackno), sizeof(struct imrsim_zone_track));
+            continue;
+        }
+        blockno -= IMR_TOP_TRACK_SIZE;   //底部磁道需要更新的块号blockno
+        topno = imrsim_bottom_wa(c, zone_idx, trackno, blockno, blockno + m - 1, NULL);
+        if(topno == TOP_TRACK_SIZE){
+            continue;
+        }
+        // A run without RMW stops before the first block needing one.
+        first = max_t(__u32, imrsim_top_to_bottom(topno), blockno);
+        if(n || first > blockno){
+            n += first - blockno;
+            break;
+        }
+        rmw->trackno = trackno;
+        imrsim_bottom_wa(c, zone_idx, trackno, blockno, blockno + m - 1, rmw->top);
+        for(k = 0; k < 2; k++){
+            rmw->nr_top += bitmap_weight(rmw->top[k], TOP_TRACK_SIZE);
+            if(trace_imrsim_wa_enabled()){
+                for_each_set_bit(topno, rmw->top[k], TOP_TRACK_SIZE){
+                    trace_imrsim_wa(zone_idx, trackno + k, topno,
+                                    (trackno + k) * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) + topno);
                 }
-                break;
-            default:
-                printk(KERN_ERR "imrsim: error: Allocation of more phases is not currently supported!\n");
+            }
         }
-        #endif
-        /* relocate bio end */
-    }else{
-        #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-        lba = bio->bi_sector;
-        #else
-        lba = bio->bi_iter.bi_sector;
-        #endif
-        printk(KERN_INFO "imrsim DIRECT write option.\n");
     }
-    
-    rv = 0;
-    elba = lba + bio_sectors;
-    z_size = num_sectors_zone();
+    accepted = ((sector_t)n << c->block_size_shift) - sector_offset;
+    if(accepted < bio_sectors){
+        dm_accept_partial_bio(bio, accepted);
+    }
+    if(remap){
+        bio->bi_iter.bi_sector = zlba + ((__u64)pba << c->block_size_shift) + sector_offset;
+    }
 
-    if ((policy_flag == 1) && (zone_status[zone_idx].z_conds == Z_COND_FULL)) {
-        zone_status[zone_idx].z_conds = Z_COND_CLOSED;     
+    rv = 0;
+    if ((policy_flag == 1) && (c->zone_status[zone_idx].z_conds == Z_COND_FULL)) {
+        c->zone_status[zone_idx].z_conds = Z_COND_CLOSED;     
+        imrsim_state_dirty(c, &c->zone_status[zone_idx], sizeof(struct imrsim_zone_status));
     } 
-    if (imrsim_dbg_log_enabled && printk_ratelimit()) {
+    if (c->dbg_log_enabled && printk_ratelimit()) {
         printk(KERN_INFO "imrsim write PASS\n");
     }
     if (rv && (policy_flag ==1)) {
         printk(KERN_ERR "imrsim: out of policy passed rule violation: %u\n", rv); 
         return IMR_ERR_OUT_OF_POLICY;
     }
-    //printk(KERN_INFO "imrsim: %s called! lba: %llu, zlba: %llu ~~\n", __FUNCTION__, lba, zlba);
-
-    trackno = (lba - zlba) / ((IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<   //lba在当前zone的第几号磁道组trackno
-                IMR_BLOCK_SIZE_SHIFT);   //lba-zlba表示lba在某个zone上的偏移量，而这个偏移量除以一个磁道组的块数就能够得到lba在多少号磁道组上。
-    // If it is a new write operation, there is no need to judge isTopTrack
-    if(ret){  //ret非0说明是更新操作，需要判断被更新的是顶部磁道还是底部磁道
-        isTopTrack = (lba - (zlba + (trackno * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<
-                    IMR_BLOCK_SIZE_SHIFT))) < (IMR_TOP_TRACK_SIZE << IMR_BLOCK_SIZE_SHIFT) ? 1 : 0;
-    }
-    printk(KERN_INFO "imrsim: %s trackno: %u, isTopTrack: %u.\n",__FUNCTION__, trackno, isTopTrack);
-
-    // record this write operation  记录写操作
-    zone_state->stats.zone_stats[zone_idx].z_write_total++;
-    zone_state->stats.write_total++;
-
-    // If lba is on the top track, mark the top track with data, and on the bottom track, determine whether to rewrite
-    //如果lba(实际是pba)在top track上，则在top track上标记data，在bottom track上，判断是否rewrite
-    if(isTopTrack){  //更新顶部磁道
-        blockno = (lba - (zlba + (trackno * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<
-                IMR_BLOCK_SIZE_SHIFT))) >> IMR_BLOCK_SIZE_SHIFT;//顶部磁道中需要更新的块
-        zone_status[zone_idx].z_tracks[trackno].isUsedBlock[blockno]=1;
-        //printk(KERN_INFO "imrsim: SIGN - block is remember\n");
-    }else{      //更新底部磁道，对相邻的顶部磁道记录写放大
-        wa_penalty=0;
-        rewriteSign=0;
-        blockno = ((lba - (zlba + (trackno * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<
-                IMR_BLOCK_SIZE_SHIFT))) >> IMR_BLOCK_SIZE_SHIFT) - IMR_TOP_TRACK_SIZE;  //底部磁道需要更新的块号blockno
-        trackrate = IMR_BOTTOM_TRACK_SIZE * 10000 / IMR_TOP_TRACK_SIZE; //底部磁道和顶部磁道中块的数量之比
-        int wa_pba1=-1,wa_pba2=-1;  //需要在相邻两个磁道上产生的写放大
-        imrsim_rmw_task.lba_num=0;   //更新底部磁道需要进行rmw过程
-        if(trackno>=0 && zone_status[zone_idx].z_tracks[trackno].isUsedBlock[(__u32)(blockno*10000/trackrate)]==1){ //trackno号磁道有数据
-            printk(KERN_INFO "imrsim: write amplification(zone_idx[%u]trackno), block: %u .\n",zone_idx, (__u32)(blockno*10000/trackrate));
-            // record write amplification  记录写放大
-            zone_state->stats.zone_stats[zone_idx].z_extra_write_total++;
-            zone_state->stats.zone_stats[zone_idx].z_write_total++;
-            zone_state->stats.extra_write_total++;
-            zone_state->stats.write_total++;
-            rewriteSign++;
-            lba = zlba + (trackno * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<IMR_BLOCK_SIZE_SHIFT) 
-                    + ((__u32)(blockno*10000/trackrate) <<IMR_BLOCK_SIZE_SHIFT);//第一个相邻顶部磁道的位置
-            imrsim_rmw_task.lba[imrsim_rmw_task.lba_num] = (sector_t)lba;       //对此位置的块进行rmw，lba强制转换成sector_t
-            imrsim_rmw_task.lba_num++;  //imrsim_rmw_task.lba[]数组位置后移一位,以记录下一个rmw
-            wa_pba1=lba>>IMR_BLOCK_SIZE_SHIFT;//记录写放大的位置-pba
-        }
-        if(trackno+1<TOP_TRACK_NUM_TOTAL && zone_status[zone_idx].z_tracks[trackno+1].isUsedBlock[(__u32)(blockno*10000/trackrate)]==1){//trackno+1号磁道有数据
-            printk(KERN_INFO "imrsim: write amplification(trackno+1), block: %u .\n", (__u32)(blockno*10000/trackrate));
-            zone_state->stats.zone_stats[zone_idx].z_extra_write_total++;
-            zone_state->stats.zone_stats[zone_idx].z_write_total++;
-            zone_state->stats.extra_write_total++;
-            zone_state->stats.write_total++;
-            rewriteSign++;
-            lba = zlba + ((trackno+1) * (IMR_TOP_TRACK_SIZE + IMR_BOTTOM_TRACK_SIZE) <<IMR_BLOCK_SIZE_SHIFT) 
-                    + ((__u32)(blockno*10000/trackrate) <<IMR_BLOCK_SIZE_SHIFT);
-            imrsim_rmw_task.lba[imrsim_rmw_task.lba_num] = (sector_t)lba;
-            imrsim_rmw_task.lba_num++;
-            wa_pba2=lba>>IMR_BLOCK_SIZE_SHIFT;
-        }
-        if(1 <= rewriteSign){
-            printk(KERN_INFO "imrsim: WA, wa_pba_1:%d,wa_pba_2:%d.\n", wa_pba1, wa_pba2);
-            return 1;
-        }
+
+    // record this write operation, and the write amplification  记录写操作和写放大
+    c->zone_state->stats.zone_stats[zone_idx].z_write_total += 1 + rmw->nr_top;
+    c->zone_state->stats.zone_stats[zone_idx].z_extra_write_total += rmw->nr_top;
+    imrsim_state_dirty(c, &c->zone_state->stats.zone_stats[zone_idx], sizeof(struct imrsim_zone_stats));
+    imrsim_dev_stats_write(c, rmw->nr_top);
+    return rmw->nr_top ? 1 : 0;
+}
+
+/* To get the PBA of a block for a read, -1 if it was never written. Runs without the zone lock. */
+static int imrsim_read_pba(struct imrsim_c *c, __u32 zone_idx, __u32 block_offset)
+{
+    if(IMR_ALLOCATION_PHASE == 1){
+        return block_offset;
     }
-    return 0;
+    return imrsim_lookup(c, zone_idx, block_offset, 0);
 }
 
-/* Device Read Rules */
-int imrsim_read_rule_check(struct bio *bio, __u32 zone_idx,    //lba所在的zone编号zone_idx
-                           sector_t bio_sectors, int policy_flag)
+/*
+ * Device Read Rules, the caller holds imrsim_state_lock but not the lock of zone_idx.
+ * The mapping of every block is walked. A read on one run of contiguous PBAs
+ * is remapped as a whole, otherwise one clone per run is put on clones and
+ * rd->bio is set, the parts never written are zero filled. The walk is done
+ * again when a write changed the mapping table meanwhile. The clones are only
+ * submitted once map returns: a pass waits for the pool only while it holds none
+ * and takes IMR_READ_MAX_RUNS at most, the read is cut where it stops.
+ */
+int imrsim_read_rule_check(struct imrsim_c *c, struct bio *bio, __u32 zone_idx,    //lba所在的zone编号zone_idx
+                           sector_t bio_sectors, int policy_flag,
+                           struct imrsim_read_task *rd, struct bio_list *clones)
 {
     __u64 lba;
     __u64 zlba;
     __u64 elba;
+    __u32 block_offset;
+    __u32 sector_offset;
+    __u32 nr_blocks;
+    __u32 n;
+    __u32 len;
+    __u32 start;
+    __u32 end;
     __u32 rv;
-    __u8 ret;
+    __u32 runs;
+    __u32 cut;
+    int pba;
+    int next;
+    int err;
+    unsigned int seq;
+    struct bio *clone;
 
-    zlba = zone_idx_lba(zone_idx);
-
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-    lba = bio->bi_sector;
-    __u32 block_offset = (lba-zlba)>>IMR_BLOCK_SIZE_SHIFT
-    ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;
-    if(ret){
-        bio->bi_sector = zlba 
-            + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT);
-        printk(KERN_INFO "imrsim: read_ops on zone %u - start lba is %llu, pba is %llu\n", zone_idx, lba, bio->bi_sector); 
-        lba = bio->bi_sector;
-    }else{
-        rv++;
-    }
-    #else
-    lba = bio->bi_iter.bi_sector;
-    if(bio->bi_private != &imrsim_completion.read_event)
-    {
-        __u32 block_offset = (lba-zlba)>>IMR_BLOCK_SIZE_SHIFT;
-        ret = zone_status[zone_idx].z_pba_map[block_offset]!=-1?1:0;
-        if(ret){   //ret!=-1 说明存在可读数据
-            bio->bi_iter.bi_sector = zlba 
-                + (zone_status[zone_idx].z_pba_map[block_offset] << IMR_BLOCK_SIZE_SHIFT)
-                + (lba-zlba)%(1<<IMR_BLOCK_SIZE_SHIFT);
-            printk(KERN_INFO "imrsim: read_ops on zone %u - start LBA is %llu, PBA is %llu\n", zone_idx, lba>>IMR_BLOCK_SIZE_SHIFT, bio->bi_iter.bi_sector>>IMR_BLOCK_SIZE_SHIFT); 
-            lba = bio->bi_iter.bi_sector;
-        }else{
-            rv++;
-            //printk(KERN_ERR "imrsim: read none data\n"); 
-        }
-    }else{
-        printk(KERN_INFO "imrsim DIRECT read option.\n");
-    }
-    
-    #endif
     rv = 0;
+    zlba = zone_idx_lba(c, zone_idx);
+    lba = bio->bi_iter.bi_sector;
     elba = lba + bio_sectors;
     
-    if(elba > (zlba + num_sectors_zone())){   //跨zone读取
+    if(elba > (zlba + num_sectors_zone(c))){   //跨zone读取
         printk(KERN_ERR "imrsim: error: read across zone: %u.%012llx.%08lx\n",
                zone_idx, lba, bio_sectors);
         rv++;
-        zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats.span_zones_count++;
-        imrsim_log_error(bio, IMR_ERR_READ_BORDER);
+        spin_lock(&c->stats_lock);
+        c->zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats.span_zones_count++;
+        imrsim_state_dirty(c, &c->zone_state->stats.zone_stats[zone_idx], sizeof(struct imrsim_zone_stats));
+        spin_unlock(&c->stats_lock);
+        imrsim_log_error(c, bio, IMR_ERR_READ_BORDER);
         if(!policy_flag){
             return IMR_ERR_READ_BORDER;
         }
         printk(KERN_ERR "imrsim:error: out of policy allowed pass\n");
+        // The part in the next zone comes back through map.
+        bio_sectors = zlba + num_sectors_zone(c) - lba;
+        dm_accept_partial_bio(bio, bio_sectors);
+    }
+    if(bio->bi_private == &c->completion.read_event){
+        return rv ? IMR_ERR_OUT_OF_POLICY : 0;
+    }
+
+    block_offset = (lba - zlba) >> c->block_size_shift;
+    sector_offset = (lba - zlba) & ((1 << c->block_size_shift) - 1);
+    nr_blocks = (sector_offset + bio_sectors + (1 << c->block_size_shift) - 1) >> c->block_size_shift;
+retry:
+    err = 0;
+    runs = 0;
+    cut = 0;
+    seq = read_seqcount_begin(imrsim_zone_seq(c, zone_idx));
+    for(n = 0; n < nr_blocks; n += len){
+        pba = imrsim_read_pba(c, zone_idx, block_offset + n);
+        if(pba < -1){
+            err = pba;   // its mapping cannot be read, a later block ends the run before
+            break;
+        }
+        for(len = 1; n + len < nr_blocks; len++){
+            next = imrsim_read_pba(c, zone_idx, block_offset + n + len);
+            if(pba == -1 ? next != -1 : next != pba + len){
+                break;
+            }
+        }
+        if(pba != -1){
+            trace_imrsim_lba_to_pba(zone_idx, block_offset + n, pba, 0);
+        }
+        if(!n && len == nr_blocks && pba != -1){
+            // Only one run, the bio itself goes to it.
+            bio->bi_iter.bi_sector = zlba + ((__u64)pba << c->block_size_shift) + sector_offset;
+            break;
+        }
+        if(!n){
+            rd->bio = bio;
+            rd->error = 0;
+            atomic_set(&rd->pending, 1);   // bias reference, dropped once all the clones are issued
+        }
+        // Sectors of the bio covered by this run.
+        start = n ? (n << c->block_size_shift) - sector_offset : 0;
+        end = ((n + len) << c->block_size_shift) - sector_offset;
+        if(end > bio_sectors){
+            end = bio_sectors;
+        }
+        clone = NULL;
+        if(runs < IMR_READ_MAX_RUNS){
+            clone = bio_alloc_clone(bio->bi_bdev, bio, bio_list_empty(clones) ? GFP_NOIO : GFP_NOWAIT,
+                                    &c->bio_set);
+        }
+        if(!clone){
+            cut = start;   // the rest of the read comes back through map
+            break;
+        }
+        runs++;
+        bio_trim(clone, start, end - start);
+        if(pba == -1){
+            zero_fill_bio(clone);
+            bio_put(clone);
+            continue;
+        }
+        clone->bi_iter.bi_sector = zlba + ((__u64)pba << c->block_size_shift)
+            + (n ? 0 : sector_offset);
+        clone->bi_end_io = imrsim_end_read_clone;
+        clone->bi_private = rd;
+        atomic_inc(&rd->pending);
+        bio_list_add(clones, clone);
+    }
+    if(err || read_seqcount_retry(imrsim_zone_seq(c, zone_idx), seq)){
+        // A torn walk, its clones are dropped. The zero filled parts are read again if mapped now.
+        while((clone = bio_list_pop(clones))){
+            bio_put(clone);
+        }
+        rd->bio = NULL;
+        if(err){
+            imrsim_log_error(c, bio, IMR_DM_IO_ERR);
+            return err;
+        }
+        goto retry;
+    }
+    if(cut){
+        dm_accept_partial_bio(bio, cut);
     }
   
-    if (imrsim_dbg_log_enabled && printk_ratelimit()) {
+    if (c->dbg_log_enabled && printk_ratelimit()) {
         printk(KERN_INFO "imrsim read PASS\n");
     }
     if (rv) {
@@ -1774,115 +4358,112 @@ int imrsim_read_rule_check(struct bio *bio, __u32 zone_idx,    //lba所在的zon
     return 0;
 }
 
-static bool imrsim_ptask_queue_ok(__u32 idx)
-{
-   __u32 qidx;
-   
-    for (qidx = 0; qidx < imrsim_ptask.stu_zone_idx_cnt; qidx++) {
-       if (abs(idx - (imrsim_ptask.stu_zone_idx[qidx]))
-          <= IMR_PSTORE_PG_EDG) {
-          return false;
-       }
-    }
-    return true;
-}
-
-static bool imrsim_ptask_gap_ok(__u32 idx)
-{
-   __u32 qidx;
-   
-    for (qidx = 0; qidx < imrsim_ptask.stu_zone_idx_cnt; qidx++) {
-       if (abs(idx - (imrsim_ptask.stu_zone_idx[qidx]))
-          <= IMR_PSTORE_PG_GAP * IMR_PSTORE_PG_EDG) {
-          return true;
-       }
-    }
-    return false;
-}
-
 /* I/O mapping */
 int imrsim_map(struct dm_target *ti, struct bio *bio)  //IO请求映射
 {
     struct imrsim_c *c = ti->private;
     int cdir = bio_data_dir(bio);      // Return the data direction, READ or WRITE.
                                        // #define bio_data_dir(bio) \ (op_is_write(bio_op(bio)) ? WRITE : READ) 
-
-    if(bio){
-        printk(KERN_INFO "imrsim_map: the bio has %u sectors.\n", bio_sectors(bio));
-    }
-
     sector_t bio_sectors = bio_sectors(bio);
     int policy_rflag = 0;
     int policy_wflag = 0;
     int ret = 0;
-    unsigned int penalty;
+    unsigned int penalty = 0;
+    bool held = false;
     __u32 zone_idx;
     __u64 lba;
+    struct imrsim_per_bio *pb = dm_per_bio_data(bio, sizeof(struct imrsim_per_bio));
+    struct imrsim_rmw_task *rmw = &pb->rmw;
+    struct mutex *zlock = NULL;
+    struct bio_list clones;
 
-    mutex_lock(&imrsim_zone_lock);   //锁上互斥锁
-    //printk(KERN_INFO "zone_lock.\n");
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-    zone_idx = bio->bi_sector >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;
-    lba = bio->bi_sector;
-    #else
-    zone_idx = bio->bi_iter.bi_sector >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;
+    down_read(&c->state_lock);   // exclude reconfiguration, other zones run in parallel
+    zone_idx = bio->bi_iter.bi_sector >> c->block_size_shift >> c->zone_size_shift;
     lba = bio->bi_iter.bi_sector;  //bio内的bvec_iter也记录了当前IO请求在磁盘上的起始扇区以及处理进度。
-    #endif
 
     //printk(KERN_INFO "imrsim: map- lba is %llu\n", lba);
+    pb->read.bio = NULL;
+    pb->delay.c = c;
+    INIT_LIST_HEAD(&pb->top.list);
+    pb->top.nr = 0;
+    bio_list_init(&clones);
 
-    imrsim_dev_idle_update();
+    imrsim_dev_idle_update(c);
 
-    if(IMR_NUMZONES <= zone_idx){
+    if(c->nr_zones <= zone_idx){
         printk(KERN_ERR "imrsim: lba is out of range. zone_idx: %u\n", zone_idx);
-        imrsim_log_error(bio, IMR_ERR_OUT_RANGE);
-        goto nomap;
+        imrsim_log_error(c, bio, IMR_ERR_OUT_RANGE);
+        up_read(&c->state_lock);
+        trace_imrsim_map(lba, bio_sectors, cdir == WRITE, zone_idx, DM_MAPIO_KILL);
+        return DM_MAPIO_KILL;
     }
-    if(imrsim_dbg_log_enabled){
+    // The first access to a zone since the load reads its mapping table, not in the submitter's context.
+    if(c->maps_lazy && test_bit_acquire(zone_idx, c->maps_lazy)){
+        up_read(&c->state_lock);
+        imrsim_fault_queue(c, bio);
+        trace_imrsim_map(lba, bio_sectors, cdir == WRITE, zone_idx, DM_MAPIO_SUBMITTED);
+        return DM_MAPIO_SUBMITTED;
+    }
+    // Only the writes change the zone, the reads walk its mapping table locklessly.
+    if(cdir == WRITE){
+        zlock = imrsim_zone_lock(c, zone_idx);
+        mutex_lock(zlock);   //锁上互斥锁
+    }
+    if(c->dbg_log_enabled){
         printk(KERN_DEBUG "imrsim: %s bio_sectors=%llu\n", __FUNCTION__, 
                 (unsigned long long)bio_sectors);
     }
-    if((lba + bio_sectors) > (zone_idx_lba(zone_idx) + 2 * num_sectors_zone())){
+    if((lba + bio_sectors) > (zone_idx_lba(c, zone_idx) + 2 * num_sectors_zone(c))){
         printk(KERN_ERR "imrsim: error: %s bio_sectors() is too large\n", __FUNCTION__);
-        imrsim_log_error(bio, IMR_ERR_OUT_OF_POLICY);
+        imrsim_log_error(c, bio, IMR_ERR_OUT_OF_POLICY);
         goto nomap;
     }
-    if(zone_status[zone_idx].z_conds == Z_COND_OFFLINE){
+    if(c->zone_status[zone_idx].z_conds == Z_COND_OFFLINE){
         printk(KERN_ERR "imrsim: error: zone is offline. zone_idx:%u\n", zone_idx);
-        imrsim_log_error(bio, IMR_ERR_ZONE_OFFLINE);
+        imrsim_log_error(c, bio, IMR_ERR_ZONE_OFFLINE);
         goto nomap;
     }
-    bio->bi_bdev = c->dev->bdev;   // struct block_device	*bi_bdev = struct block_device *bdev
-    policy_rflag = zone_state->config.dev_config.out_of_policy_read_flag;
-    policy_wflag = zone_state->config.dev_config.out_of_policy_write_flag;
+    bio_set_dev(bio, c->dev->bdev);
+    if(!bio_sectors){
+        goto mapped;   // a flush has no block to map
+    }
+    policy_rflag = c->zone_state->config.dev_config.out_of_policy_read_flag;
+    policy_wflag = c->zone_state->config.dev_config.out_of_policy_write_flag;
     
     // read or write ?
     if(cdir == WRITE){
-        if(imrsim_dbg_log_enabled){
+        if(c->dbg_log_enabled){
             printk(KERN_DEBUG "imrsim: %s WRITE %u.%012llx:%08lx.\n", __FUNCTION__,
                 zone_idx, lba, bio_sectors);
         }
-        if ((zone_status[zone_idx].z_conds == Z_COND_RO) && !policy_wflag) {  //！polic_wflag代表无法写
+        if ((c->zone_status[zone_idx].z_conds == Z_COND_RO) && !policy_wflag) {  //！polic_wflag代表无法写
             printk(KERN_ERR "imrsim:error: zone is read only. zone_idx: %u\n", zone_idx);  
-            imrsim_log_error(bio, IMR_ERR_WRITE_RO);
+            imrsim_log_error(c, bio, IMR_ERR_WRITE_RO);
             goto nomap;
         }
-        if ((zone_status[zone_idx].z_conds == Z_COND_FULL) &&
-            (lba != zone_idx_lba(zone_idx)) && !policy_wflag) {
+        if ((c->zone_status[zone_idx].z_conds == Z_COND_FULL) &&
+            (lba != zone_idx_lba(c, zone_idx)) && !policy_wflag) {
             printk(KERN_ERR "imrsim:error: zone is full. zone_idx: %u\n", zone_idx);
-            imrsim_log_error(bio, IMR_ERR_WRITE_FULL);
+            imrsim_log_error(c, bio, IMR_ERR_WRITE_FULL);
             goto nomap;
         }
-        ret = imrsim_write_rule_check(bio, zone_idx, bio_sectors, policy_wflag);  // ret=-242/1/0，1代表发生重写，0代表无重写
+        if(IMR_ALLOCATION_PHASE != 1 && imrsim_zone_map_alloc(c, zone_idx)){
+            printk(KERN_ERR "imrsim: error: no memory for the mapping table of zone %u\n", zone_idx);
+            goto nomap;
+        }
+        ret = imrsim_write_rule_check(c, bio, zone_idx, bio_sectors, policy_wflag, rmw, &pb->top);  // ret=-242/1/0，1代表发生重写，0代表无重写
+        if(ret == -EIO){
+            printk(KERN_ERR "imrsim: error: cannot update the mapping table of zone %u\n", zone_idx);
+            goto nomap;
+        }
+        bio_sectors = bio_sectors(bio);   // the rest of a cut bio comes back through map
         if(ret<0){
             if(policy_wflag == 1 && policy_rflag == 1){
                 goto mapped;     //map函数修改了bio的内容，希望DM将bio按照新内容再分发
             }
-            penalty = 0;      
             if(policy_wflag == 1){
-                penalty = zone_state->config.dev_config.w_time_to_rmw_zone;
+                penalty = c->zone_state->config.dev_config.w_time_to_rmw_zone;   //map返回后由hrtimer延迟
                 printk(KERN_ERR "imrsim: %s: write error passed: out of policy write flagged on\n", __FUNCTION__);
-                udelay(penalty);   //延迟函数
             }else{
                 goto nomap;
             }
@@ -1890,66 +4471,96 @@ int imrsim_map(struct dm_target *ti, struct bio *bio)  //IO请求映射
         if(ret>0){
             goto submitted;   //map函数将bio赋值后又分发出去
         }
-        imrsim_ptask.flag |= IMR_STATUS_CHANGE;
-        if(imrsim_ptask.stu_zone_idx_cnt == IMR_PSTORE_QDEPTH){
-            imrsim_ptask.stu_zone_idx_gap = IMR_PSTORE_PG_GAP;
-        }else if(imrsim_ptask_queue_ok(zone_idx)){
-            imrsim_ptask.stu_zone_idx[imrsim_ptask.stu_zone_idx_cnt] = zone_idx;
-            imrsim_ptask.stu_zone_idx_cnt++;
-            if(!imrsim_ptask_gap_ok(zone_idx)){
-                imrsim_ptask.stu_zone_idx_gap++;
-            }
-        }
+        imrsim_pstore_mark(c, IMR_STATUS_CHANGE);
     }
     else if(cdir == READ){
-        if (imrsim_dbg_log_enabled) {
+        if (c->dbg_log_enabled) {
             printk(KERN_DEBUG "imrsim: %s READ %u.%012llx:%08lx.\n", __FUNCTION__,
                     zone_idx, lba, bio_sectors);
         }
-        ret = imrsim_read_rule_check(bio, zone_idx, bio_sectors, policy_rflag); //ret=-242或0
+        ret = imrsim_read_rule_check(c, bio, zone_idx, bio_sectors, policy_rflag, &pb->read, &clones); //ret=-242或0
+        bio_sectors = bio_sectors(bio);
+        if(ret == -EIO){
+            goto nomap;
+        }
         if(ret){  //ret=-242=IMR_ERR_OUT_OF_POLICY
             if(policy_wflag == 1 && policy_rflag == 1){
                 printk(KERN_ERR "imrsim: out of policy read passthrough applied\n");
                 goto mapped;
             }
-            penalty = 0;
             if(policy_rflag == 1){
-                penalty = zone_state->config.dev_config.r_time_to_rmw_zone;
+                penalty = c->zone_state->config.dev_config.r_time_to_rmw_zone;
                 if(printk_ratelimit()){
                     printk(KERN_ERR "imrsim:%s: read error passed: out of policy read flagged on\n", 
                   __FUNCTION__);
                 }
-                udelay(penalty);
             }else{
                 goto nomap;
             }
         }
     }
     mapped:
+    if(pb->read.bio){
+        goto split;
+    }
     if (bio_sectors(bio))   //bio内sector的数量
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-        bio->bi_sector =  imrsim_map_sector(ti,bio->bi_sector);
-    #else
         bio->bi_iter.bi_sector =  imrsim_map_sector(ti, bio->bi_iter.bi_sector);
-    #endif
-    mutex_unlock(&imrsim_zone_lock);   //解锁
-    //printk(KERN_INFO "zone_unlock.\n");
+    if(pb->top.nr){
+        // A running RMW of the top-track blocks sends the write out when it is done, undelayed.
+        spin_lock_irq(&c->batcher.lock);
+        held = imrsim_top_write_start(c, &pb->top, bio);
+        spin_unlock_irq(&c->batcher.lock);
+    }
+    if(zlock){
+        mutex_unlock(zlock);   //解锁
+    }
+    up_read(&c->state_lock);
+    if(held){
+        trace_imrsim_map(lba, bio_sectors, 1, zone_idx, DM_MAPIO_SUBMITTED);
+        return DM_MAPIO_SUBMITTED;
+    }
+    if(penalty){
+        // The bio is remapped, it is sent to the device when the timer fires.
+        imrsim_delay_queue(&pb->delay, bio, penalty);
+        trace_imrsim_map(lba, bio_sectors, cdir == WRITE, zone_idx, DM_MAPIO_SUBMITTED);
+        return DM_MAPIO_SUBMITTED;
+    }
+    trace_imrsim_map(lba, bio_sectors, cdir == WRITE, zone_idx, DM_MAPIO_REMAPPED);
     return DM_MAPIO_REMAPPED;          //map函数修改了bio的内容，希望DM将bio按照新内容再分发
 
     submitted:
-    printk(KERN_INFO "imrsim_map: submitted and conduct rmw!\n");
-    imrsim_rmw_task.bio = bio;//将bio放入rmw的bio中，以进行rmw过程
-    imrsim_rmw_thread(ti);
-    mutex_unlock(&imrsim_zone_lock);
-    printk(KERN_INFO "imrsim_map: end rmw!\n");
+    bio->bi_iter.bi_sector = imrsim_map_sector(ti, bio->bi_iter.bi_sector);
+    imrsim_rmw_queue(ti, zone_idx, rmw, bio);//将bio放入rmw的bio中，以进行rmw过程
+    mutex_unlock(zlock);
+    up_read(&c->state_lock);
+    trace_imrsim_map(lba, bio_sectors, 1, zone_idx, DM_MAPIO_SUBMITTED);
     return DM_MAPIO_SUBMITTED;     //已提交bio
 
+    split:
+    up_read(&c->state_lock);
+    imrsim_read_submit(ti, &pb->read, &clones, penalty);   // a penalty delays the completion
+    trace_imrsim_map(lba, bio_sectors, 0, zone_idx, DM_MAPIO_SUBMITTED);
+    return DM_MAPIO_SUBMITTED;
+
     nomap:
-    imrsim_ptask.flag |= IMR_STATS_CHANGE;
-    imrsim_ptask.sts_zone_idx = zone_idx;
-    mutex_unlock(&imrsim_zone_lock);
-    //printk(KERN_INFO "zone_unlock.\n");
-    return IMR_DM_IO_ERR;
+    imrsim_pstore_mark(c, IMR_STATS_CHANGE);
+    if(zlock){
+        mutex_unlock(zlock);
+    }
+    up_read(&c->state_lock);
+    trace_imrsim_map(lba, bio_sectors, cdir == WRITE, zone_idx, DM_MAPIO_KILL);
+    return DM_MAPIO_KILL;
+}
+
+/* Bio completion, a top-track write leaves the writes in flight */
+static int imrsim_end_io(struct dm_target *ti, struct bio *bio, blk_status_t *error)
+{
+    struct imrsim_per_bio *pb = dm_per_bio_data(bio, sizeof(struct imrsim_per_bio));
+
+    if(!list_empty(&pb->top.list)){
+        imrsim_top_write_end(ti->private, &pb->top);
+    }
+    return DM_ENDIO_DONE;
 }
 
 /* Device status query */
@@ -1960,6 +4571,7 @@ static void imrsim_status(struct dm_target* ti,   //imrsim_c状态查询
                           unsigned maxlen)
 {
    struct imrsim_c* c   = ti->private;
+   unsigned int features;
 
    switch(type)
    {
@@ -1970,6 +4582,30 @@ static void imrsim_status(struct dm_target* ti,   //imrsim_c状态查询
       case STATUSTYPE_TABLE:
          snprintf(result, maxlen, "%s %llu", c->dev->name,
 	    (unsigned long long)c->start);
+         features = (c->rmw_durability == IMR_RMW_DURABLE_FLUSH) + (c->map_mode == IMR_MAP_EXTENT) +
+                    2 * (c->ptask.max_stale != IMR_PSTORE_STALE) + 2 * (c->ptask.min_batch != IMR_PSTORE_BATCH);
+         if(features){
+            scnprintf(result + strlen(result), maxlen - strlen(result), " %u%s%s", features,
+                      c->rmw_durability == IMR_RMW_DURABLE_FLUSH ? " rmw_flush" : "",
+                      c->map_mode == IMR_MAP_EXTENT ? " map_extent" : "");
+         }
+         if(c->ptask.max_stale != IMR_PSTORE_STALE){
+            scnprintf(result + strlen(result), maxlen - strlen(result), " max_stale %u", c->ptask.max_stale);
+         }
+         if(c->ptask.min_batch != IMR_PSTORE_BATCH){
+            scnprintf(result + strlen(result), maxlen - strlen(result), " min_batch %u", c->ptask.min_batch);
+         }
+         break;
+
+      case STATUSTYPE_IMA:
+         snprintf(result, maxlen, "target_name=%s,target_version=%u.%u.%u,"
+                  "device_name=%s,start=%llu,rmw_durability=%s,map_mode=%s,"
+                  "max_stale=%u,min_batch=%u;",
+                  ti->type->name, ti->type->version[0], ti->type->version[1],
+                  ti->type->version[2], c->dev->name, (unsigned long long)c->start,
+                  c->rmw_durability == IMR_RMW_DURABLE_FLUSH ? "flush" : "fua",
+                  c->map_mode == IMR_MAP_EXTENT ? "extent" : "block",
+                  c->ptask.max_stale, c->ptask.min_batch);
          break;
    }
 }
@@ -1990,10 +4626,19 @@ static void imrsim_list_zone_status(struct imrsim_zone_status *ptr,
    }
 }
 
+/* To copy the status of a zone while holding its lock. */
+static void imrsim_copy_zone_status(struct imrsim_c *c, struct imrsim_zone_status *dst, __u32 zone_idx)
+{
+    mutex_lock(imrsim_zone_lock(c, zone_idx));
+    memcpy(dst, &c->zone_status[zone_idx], sizeof(struct imrsim_zone_status));
+    mutex_unlock(imrsim_zone_lock(c, zone_idx));
+}
+
 /* Query zone status information and record the result in ptr */
-int imrsim_query_zones(sector_t lba, int criteria,
+int imrsim_query_zones(struct dm_target *ti, sector_t lba, int criteria,
                        __u32 *num_zones, struct imrsim_zone_status *ptr)
 {
+    struct imrsim_c *c = ti->private;
     int idx32;
     __u32 num32;
     __u32 zone_idx;
@@ -2002,38 +4647,37 @@ int imrsim_query_zones(sector_t lba, int criteria,
         printk(KERN_ERR "imrsim: NULL pointer passed through.\n");
         return -EINVAL;
     }
-    mutex_lock(&imrsim_zone_lock);
-    zone_idx = lba >> IMR_BLOCK_SIZE_SHIFT >> IMR_ZONE_SIZE_SHIFT;
-    if(0 == *num_zones || IMR_NUMZONES < (*num_zones + zone_idx)){
-        mutex_unlock(&imrsim_zone_lock);
+    down_read(&c->state_lock);
+    zone_idx = lba >> c->block_size_shift >> c->zone_size_shift;
+    if(0 == *num_zones || c->nr_zones < (*num_zones + zone_idx)){
+        up_read(&c->state_lock);
         printk(KERN_ERR "imrsim: number of zone out of range\n");
         return -EINVAL;
     }
-    if (imrsim_dbg_log_enabled) {   
-        imrsim_list_zone_status(zone_status, *num_zones, criteria);
+    if (c->dbg_log_enabled) {   
+        imrsim_list_zone_status(c->zone_status, *num_zones, criteria);
     }
     if(criteria > 0){
         idx32 = 0; 
         for (num32 = 0; num32 < *num_zones; num32++) {
-            memcpy((ptr + idx32), &zone_status[zone_idx + num32], 
-                sizeof(struct imrsim_zone_status));
+            imrsim_copy_zone_status(c, ptr + idx32, zone_idx + num32);
             idx32++;
         }
         *num_zones = idx32;
-        mutex_unlock(&imrsim_zone_lock);
+        up_read(&c->state_lock);
         return 0;  
     }
     switch(criteria){
         case ZONE_MATCH_ALL:
-            memcpy(ptr, &zone_status[zone_idx], *num_zones * 
-                sizeof(struct imrsim_zone_status));
+            for (num32 = 0; num32 < *num_zones; num32++) {
+                imrsim_copy_zone_status(c, ptr + num32, zone_idx + num32);
+            }
             break;
         case ZONE_MATCH_FULL:
             idx32 = 0; 
-            for (num32 = zone_idx; num32 < IMR_NUMZONES; num32++) {
-                if (Z_COND_FULL == zone_status[num32].z_conds) {
-                    memcpy((ptr + idx32), &zone_status[num32], 
-                            sizeof(struct imrsim_zone_status));
+            for (num32 = zone_idx; num32 < c->nr_zones; num32++) {
+                if (Z_COND_FULL == c->zone_status[num32].z_conds) {
+                    imrsim_copy_zone_status(c, ptr + idx32, num32);
                     idx32++;
                     if (idx32 == *num_zones) {
                         break;
@@ -2044,9 +4688,8 @@ int imrsim_query_zones(sector_t lba, int criteria,
             break;
         case ZONE_MATCH_NFULL:
             idx32 = 0;
-            for (num32 = zone_idx; num32 < IMR_NUMZONES; num32++) {
-                memcpy((ptr + idx32), &zone_status[num32], 
-                        sizeof(struct imrsim_zone_status));
+            for (num32 = zone_idx; num32 < c->nr_zones; num32++) {
+                imrsim_copy_zone_status(c, ptr + idx32, num32);
                 idx32++;
                 if (idx32 == *num_zones) {
                     break;
@@ -2056,10 +4699,9 @@ int imrsim_query_zones(sector_t lba, int criteria,
             break;
         case ZONE_MATCH_FREE:
             idx32 = 0;
-            for (num32 = zone_idx; num32 < IMR_NUMZONES; num32++) {
-                if ((Z_COND_EMPTY == zone_status[num32].z_conds)) {
-                    memcpy((ptr + idx32), &zone_status[num32], 
-                            sizeof(struct imrsim_zone_status));
+            for (num32 = zone_idx; num32 < c->nr_zones; num32++) {
+                if ((Z_COND_EMPTY == c->zone_status[num32].z_conds)) {
+                    imrsim_copy_zone_status(c, ptr + idx32, num32);
                     idx32++;
                     if (idx32 == *num_zones) {
                         break;
@@ -2070,10 +4712,9 @@ int imrsim_query_zones(sector_t lba, int criteria,
             break;
         case ZONE_MATCH_RNLY:
             idx32 = 0;
-            for (num32 = zone_idx; num32 < IMR_NUMZONES; num32++) {
-                if (Z_COND_RO == zone_status[num32].z_conds) {
-                memcpy((ptr + idx32), &zone_status[num32], 
-                        sizeof(struct imrsim_zone_status));
+            for (num32 = zone_idx; num32 < c->nr_zones; num32++) {
+                if (Z_COND_RO == c->zone_status[num32].z_conds) {
+                imrsim_copy_zone_status(c, ptr + idx32, num32);
                 idx32++;
                 if (idx32 == *num_zones) {
                     break;
@@ -2084,10 +4725,9 @@ int imrsim_query_zones(sector_t lba, int criteria,
             break;
         case ZONE_MATCH_OFFL:
             idx32 = 0;
-            for (num32 = zone_idx; num32 < IMR_NUMZONES; num32++) {
-                if (Z_COND_OFFLINE == zone_status[num32].z_conds) {
-                memcpy((ptr + idx32), &zone_status[num32], 
-                        sizeof(struct imrsim_zone_status));
+            for (num32 = zone_idx; num32 < c->nr_zones; num32++) {
+                if (Z_COND_OFFLINE == c->zone_status[num32].z_conds) {
+                imrsim_copy_zone_status(c, ptr + idx32, num32);
                 idx32++;
                 if (idx32 == *num_zones) {
                     break;
@@ -2099,7 +4739,7 @@ int imrsim_query_zones(sector_t lba, int criteria,
         default:
             printk("imrsim: wrong query parameter\n");
     }
-    mutex_unlock(&imrsim_zone_lock);
+    up_read(&c->state_lock);
    return 0;
 }
 EXPORT_SYMBOL(imrsim_query_zones);//使用EXPORT_SYMBOL可以将一个函数以符号的方式导出给其他模块使用
@@ -2109,6 +4749,7 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                  unsigned int cmd,
                  unsigned long arg)
 {
+    struct imrsim_c *c = ti->private;
     imrsim_zbc_query          *zbc_query;
     struct imrsim_dev_config   pconf;
     //struct imrsim_zone_status  pstatus;
@@ -2116,14 +4757,14 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
     int                        ret = 0;
     __u32                      size  = 0;
     __u64                      num64;
-    __u32                      param = IMR_NUMZONES;
+    __u32                      param = c->nr_zones;
     
-    imrsim_dev_idle_update();
-    mutex_lock(&imrsim_ioctl_lock);
+    imrsim_dev_idle_update(c);
+    mutex_lock(&c->ioctl_lock);
     switch(cmd)
     {
         case IOCTL_IMRSIM_GET_LAST_RERROR:
-            if(imrsim_get_last_rd_error(&param)){
+            if(imrsim_get_last_rd_error(ti, &param)){
                 printk(KERN_ERR "imrsim: get last rd error failed\n");
                 goto ioerr;
             }
@@ -2137,7 +4778,7 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             }
             break;
         case IOCTL_IMRSIM_GET_LAST_WERROR:
-            if(imrsim_get_last_wd_error(&param)){
+            if(imrsim_get_last_wd_error(ti, &param)){
                 printk(KERN_ERR "imrsim: get last wd error failed\n");
                 goto ioerr;
             }
@@ -2152,19 +4793,19 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             break;
         /* zone ioctl */
         case IOCTL_IMRSIM_SET_LOGENABLE:
-            if(imrsim_set_log_enable(1)){
+            if(imrsim_set_log_enable(ti, 1)){
                 printk(KERN_ERR "imrsim: enable log failed\n");
                 goto ioerr;
             }
             break;
         case IOCTL_IMRSIM_SET_LOGDISABLE:
-            if(imrsim_set_log_enable(0)){
+            if(imrsim_set_log_enable(ti, 0)){
                 printk(KERN_ERR "imrsim: disable log failed\n");
                 goto ioerr;
             }
             break;
         case IOCTL_IMRSIM_GET_NUMZONES:
-            if(imrsim_get_num_zones(&param)){
+            if(imrsim_get_num_zones(ti, &param)){
                 printk(KERN_ERR "imrsim: get number of zones failed\n");
                 goto ioerr;
             }
@@ -2178,7 +4819,7 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             }
             break;
         case IOCTL_IMRSIM_GET_SIZZONEDEFAULT:
-            if(imrsim_get_size_zone_default(&param)){
+            if(imrsim_get_size_zone_default(ti, &param)){
                 printk(KERN_ERR "imrsim: get zone size failed\n");
                 goto ioerr;
             }
@@ -2200,11 +4841,11 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                 printk(KERN_ERR "imrsim: set zone size copy from user failed\n");
                 goto ioerr;
             }
-            if(imrsim_set_size_zone_default(param)){
+            if(imrsim_set_size_zone_default(ti, param)){
                 printk(KERN_ERR "imrsim: set default zone size failed\n");
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_RESET_ZONE:
             if((__u64)arg == 0){
@@ -2215,11 +4856,11 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                 printk(KERN_ERR "imrsim: reset zone write pointer copy from user memory failed\n");
                 goto ioerr;
             }
-            if(imrsim_blkdev_reset_zone_ptr(num64)){
+            if(imrsim_blkdev_reset_zone_ptr(ti, num64)){
                 printk(KERN_ERR "imrsim: reset zone write pointer failed\n");
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_QUERY:
             zbc_query = kzalloc(sizeof(imrsim_zbc_query), GFP_KERNEL);
@@ -2236,7 +4877,7 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                 printk(KERN_ERR "imrsim: %s copy from user for zbc query failed\n", __FUNCTION__);
                 goto zfail;
             }
-            if (zbc_query->num_zones == 0 || zbc_query->num_zones > IMR_NUMZONES) {
+            if (zbc_query->num_zones == 0 || zbc_query->num_zones > c->nr_zones) {
                 printk(KERN_ERR "imrsim: Wrong parameter for the number of zones\n");
                 goto zfail;
             }
@@ -2247,7 +4888,7 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                 printk(KERN_ERR "imrsim: %s no enough emeory for zbc query\n", __FUNCTION__);
                 goto zfail;
             } 
-            if (imrsim_query_zones(zbc_query->lba, zbc_query->criteria, 
+            if (imrsim_query_zones(ti, zbc_query->lba, zbc_query->criteria, 
                 &zbc_query->num_zones, zbc_query->ptr)) {
                 printk(KERN_ERR "imrsim: %s query zone status failed\n", __FUNCTION__);
                 goto zfail;            
@@ -2263,18 +4904,18 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             break;
         /* IMRSIM stats IOCTLs */
         case IOCTL_IMRSIM_GET_STATS:
-            size = imrsim_stats_size();
+            size = imrsim_stats_size(c);
             pstats = (struct imrsim_stats *)kzalloc(size, GFP_ATOMIC);
             if(!pstats){
                 printk(KERN_ERR "imrsim: no enough memory to hold stats\n");
                 goto ioerr;
             }
-            if(imrsim_get_stats(pstats)){
+            if(imrsim_get_stats(ti, pstats)){
                 printk(KERN_ERR "imrsim: get stats failed\n");
                 kfree(pstats);
                 goto sfail;
             }
-            if(imrsim_dbg_log_enabled){
+            if(c->dbg_log_enabled){
                 imrsim_report_stats(pstats);
             }
             if((__u64)arg == 0){
@@ -2292,11 +4933,11 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             kfree(pstats);
             break;
         case IOCTL_IMRSIM_RESET_STATS:
-            if(imrsim_reset_stats()){
+            if(imrsim_reset_stats(ti)){
                 printk(KERN_ERR "imrsim: reset stats failed\n");
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_RESET_ZONESTATS:
             if((__u64)arg == 0){
@@ -2307,33 +4948,33 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
                 printk(KERN_ERR "imrsim: copy reset zone lba from user memory failed\n");
                 goto ioerr;
             }
-            if(imrsim_reset_zone_stats(num64)){
+            if(imrsim_reset_zone_stats(ti, num64)){
                 printk(KERN_ERR "imrsim: reset zone stats on lba failed");
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         /* IMRSIM config IOCTLs */
         case IOCTL_IMRSIM_RESET_DEFAULTCONFIG:
-            if(imrsim_reset_default_config()){
+            if(imrsim_reset_default_config(ti)){
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_RESET_ZONECONFIG:
-            if(imrsim_reset_default_zone_config()){
+            if(imrsim_reset_default_zone_config(ti)){
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_RESET_DEVCONFIG:
-            if(imrsim_reset_default_device_config()){
+            if(imrsim_reset_default_device_config(ti)){
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_GET_DEVCONFIG:
-            if(imrsim_get_device_config(&pconf)){
+            if(imrsim_get_device_config(ti, &pconf)){
                 goto ioerr;
             }
             if((__u64)arg == 0){
@@ -2352,10 +4993,10 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             if(copy_from_user(&pconf, (struct imrsim_dev_config *)arg, sizeof(struct imrsim_dev_config) )){
                 goto ioerr;
             }
-            if(imrsim_set_device_rconfig_delay(&pconf)){
+            if(imrsim_set_device_rconfig_delay(ti, &pconf)){
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         case IOCTL_IMRSIM_SET_DEVWCONFIG_DELAY:
             if ((__u64)arg == 0) {
@@ -2365,41 +5006,33 @@ int imrsim_ioctl(struct dm_target *ti,   //向用户程序暴露的ioctl接口
             if(copy_from_user(&pconf, (struct imrsim_dev_config *)arg, sizeof(struct imrsim_dev_config) )){
                 goto ioerr;
             }
-            if(imrsim_set_device_wconfig_delay(&pconf)){
+            if(imrsim_set_device_wconfig_delay(ti, &pconf)){
                 goto ioerr;
             }
-            imrsim_ptask.flag |= IMR_CONFIG_CHANGE;
+            imrsim_pstore_mark(c, IMR_CONFIG_CHANGE);
             break;
         default:
             break;
     }
-    if(imrsim_ptask.flag & IMR_CONFIG_CHANGE){
-        wake_up_process(imrsim_ptask.pstore_thread);
-    }
-    mutex_unlock(&imrsim_ioctl_lock);
+    mutex_unlock(&c->ioctl_lock);
     return 0;
     ioerr:
-    mutex_unlock(&imrsim_ioctl_lock);
+    mutex_unlock(&c->ioctl_lock);
     return -EFAULT;
 }
 
-/* To merge requests. */
-static int imrsim_merge(struct dm_target* ti,                //IO请求合并
-                        struct bvec_merge_data* bvm,
-                        struct bio_vec* biovec, 
-                        int max_size)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+/* To serve the ioctls of the mapped device here instead of forwarding them to the underlying one. */
+static int imrsim_prepare_ioctl(struct dm_target *ti,
+                                struct block_device **bdev,
+                                unsigned int cmd,
+                                unsigned long arg,
+                                bool *forward)
 {
-   struct imrsim_c*      c = ti->private;
-   struct request_queue* q = bdev_get_queue(c->dev->bdev);
-
-   if (!q->merge_bvec_fn)  //merge_bvec_fn用于确定一个现存的请求是否允许添加更多的数据。
-      return max_size;
-
-   bvm->bi_bdev   = c->dev->bdev;
-   bvm->bi_sector = imrsim_map_sector(ti, bvm->bi_sector);
-
-   return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
+    *forward = false;
+    return imrsim_ioctl(ti, cmd, arg);
 }
+#endif
 
 /* iterate devices */
 static int imrsim_iterate_devices(struct dm_target *ti,     //imrsim_c设备迭代
@@ -2423,9 +5056,13 @@ static struct target_type imrsim_target =
     .ctr             = imrsim_ctr,
     .dtr             = imrsim_dtr,
     .map             = imrsim_map,
+    .end_io          = imrsim_end_io,
     .status          = imrsim_status,
-    .ioctl           = imrsim_ioctl,
-    .merge           = imrsim_merge,
+    .postsuspend     = imrsim_postsuspend,
+    .preresume       = imrsim_preresume,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+    .prepare_ioctl   = imrsim_prepare_ioctl,
+#endif
     .iterate_devices = imrsim_iterate_devices
 };
 
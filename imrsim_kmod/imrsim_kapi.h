@@ -1,6 +1,12 @@
 #ifndef _IMRSIM_KAPI_H
 #define _IMRSIM_KAPI_H
 
+/*
+ * Every function acts on the simulated device of the target ti, so that
+ * several IMRSim targets can be configured independently.
+ */
+struct dm_target;
+
 /*
  * IMRSIM_GET_LAST_WERROR
  *
@@ -9,7 +15,7 @@
  * Returns 0 if operation is successful, negative otherwise. 
  *
  */
-int imrsim_get_last_wd_error(__u32 *last_error);
+int imrsim_get_last_wd_error(struct dm_target *ti, __u32 *last_error);
 
 /*
  * IMRSIM_GET_LAST_RERROR
@@ -19,7 +25,7 @@ int imrsim_get_last_wd_error(__u32 *last_error);
  * Returns 0 if operation is successful, negative otherwise. 
  *
  */
-int imrsim_get_last_rd_error(__u32 *last_error);
+int imrsim_get_last_rd_error(struct dm_target *ti, __u32 *last_error);
 
 /*
  * IMRSIM_SET_LOGENABLE
@@ -29,7 +35,7 @@ int imrsim_get_last_rd_error(__u32 *last_error);
  * Returns 0 if operation is successful, negative otherwise. 
  *
  */
-int imrsim_set_log_enable(__u32 zero_is_disable);
+int imrsim_set_log_enable(struct dm_target *ti, __u32 zero_is_disable);
 
 /*
  * IMRSIM_GET_NUMZONES
@@ -39,7 +45,7 @@ int imrsim_set_log_enable(__u32 zero_is_disable);
  * Returns 0 if operation is successful, negative otherwise. 
  *
  */
-int imrsim_get_num_zones(__u32 *num_zones);
+int imrsim_get_num_zones(struct dm_target *ti, __u32 *num_zones);
 
 /*
  * IMRSIM_GET_SIZZONEDEFAULT
@@ -49,7 +55,7 @@ int imrsim_get_num_zones(__u32 *num_zones);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_get_size_zone_default(__u32 *siz_zone);
+int imrsim_get_size_zone_default(struct dm_target *ti, __u32 *siz_zone);
 
 /*
  * IMRSIM_SET_SIZZONEDEFAULT
@@ -59,7 +65,7 @@ int imrsim_get_size_zone_default(__u32 *siz_zone);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_set_size_zone_default(__u32 siz_zone);
+int imrsim_set_size_zone_default(struct dm_target *ti, __u32 siz_zone);
 
 /*
  * IMRSIM_RESET_ZONE
@@ -67,7 +73,7 @@ int imrsim_set_size_zone_default(__u32 siz_zone);
  * Reset the write pointer for a sequential write zone.
  *
  */
-int imrsim_blkdev_reset_zone_ptr(sector_t start_sector);
+int imrsim_blkdev_reset_zone_ptr(struct dm_target *ti, sector_t start_sector);
 
 /*
  * IMRSIM_QUERY
@@ -102,7 +108,7 @@ int imrsim_blkdev_reset_zone_ptr(sector_t start_sector);
  * these criteria itself, without needing to issue a ZBC command for
  * each call to blkdev_query_zones().
  */
-int imrsim_query_zones(sector_t start_sector,
+int imrsim_query_zones(struct dm_target *ti, sector_t start_sector,
                        int free_sectors_criteria, 
                        __u32 *max_zones,
                        struct imrsim_zone_status *ret_zones);
@@ -116,7 +122,7 @@ int imrsim_query_zones(sector_t start_sector,
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_get_stats(struct imrsim_stats *stats);
+int imrsim_get_stats(struct dm_target *ti, struct imrsim_stats *stats);
 
 /*
  * IMRSIM_RESET_STATS
@@ -126,7 +132,7 @@ int imrsim_get_stats(struct imrsim_stats *stats);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_reset_stats(void);
+int imrsim_reset_stats(struct dm_target *ti);
 
 /*
  * IMRSIM_RESET_ZONESTATS
@@ -137,7 +143,7 @@ int imrsim_reset_stats(void);
  * not the beginning of a sequential write zone.
  *
  */
-int imrsim_reset_zone_stats(sector_t start_sector);
+int imrsim_reset_zone_stats(struct dm_target *ti, sector_t start_sector);
 
 /*
  * IMRSIM_GET_DEVSTATS
@@ -147,7 +153,7 @@ int imrsim_reset_zone_stats(sector_t start_sector);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_get_device_stats(struct imrsim_dev_stats *device_stats);
+int imrsim_get_device_stats(struct dm_target *ti, struct imrsim_dev_stats *device_stats);
 /*
  * IMRSIM_GET_ZONESTATS
  *
@@ -159,7 +165,7 @@ int imrsim_get_device_stats(struct imrsim_dev_stats *device_stats);
  * sequential write zone.
  *
  */
-int imrsim_get_zone_stats(sector_t start_sector,
+int imrsim_get_zone_stats(struct dm_target *ti, sector_t start_sector,
                           struct imrsim_zone_stats *zone_stats);
 /*
  * IMRSIM_RESET_DEFAULTCONFIG
@@ -169,7 +175,7 @@ int imrsim_get_zone_stats(sector_t start_sector,
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_reset_default_config(void);
+int imrsim_reset_default_config(struct dm_target *ti);
 
 /*
  *
@@ -181,7 +187,7 @@ int imrsim_reset_default_config(void);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_reset_default_zone_config(void);
+int imrsim_reset_default_zone_config(struct dm_target *ti);
 
 /*
  * IMRSIM_RESET_DEVCONFIG
@@ -191,7 +197,7 @@ int imrsim_reset_default_zone_config(void);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_reset_default_device_config(void);
+int imrsim_reset_default_device_config(struct dm_target *ti);
 
 /*
  * IMRSIM_GET_DEVCONFIG
@@ -201,7 +207,7 @@ int imrsim_reset_default_device_config(void);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_get_device_config(struct imrsim_dev_config *device_config);
+int imrsim_get_device_config(struct dm_target *ti, struct imrsim_dev_config *device_config);
 
 /*
  * IMRSIM_SET_DEVRCONFIG
@@ -211,7 +217,7 @@ int imrsim_get_device_config(struct imrsim_dev_config *device_config);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_set_device_rconfig(struct imrsim_dev_config *device_config);
+int imrsim_set_device_rconfig(struct dm_target *ti, struct imrsim_dev_config *device_config);
 
 /*
  * IMRSIM_SET_DEVWCONFIG
@@ -221,7 +227,7 @@ int imrsim_set_device_rconfig(struct imrsim_dev_config *device_config);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_set_device_wconfig(struct imrsim_dev_config *device_config);
+int imrsim_set_device_wconfig(struct dm_target *ti, struct imrsim_dev_config *device_config);
 
 /*
  * IMRSIM_SET_DEVRCONFIG_DELAY
@@ -231,7 +237,7 @@ int imrsim_set_device_wconfig(struct imrsim_dev_config *device_config);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_set_device_rconfig_delay(struct imrsim_dev_config *device_config);
+int imrsim_set_device_rconfig_delay(struct dm_target *ti, struct imrsim_dev_config *device_config);
 
 /*
  * IMRSIM_SET_DEVWCONFIG_DELAY
@@ -241,7 +247,7 @@ int imrsim_set_device_rconfig_delay(struct imrsim_dev_config *device_config);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-int imrsim_set_device_wconfig_delay(struct imrsim_dev_config *device_config);
+int imrsim_set_device_wconfig_delay(struct dm_target *ti, struct imrsim_dev_config *device_config);
 
 /*
  * IMRSIM_CLEAR_ZONECONFIG
@@ -251,7 +257,7 @@ int imrsim_set_device_wconfig_delay(struct imrsim_dev_config *device_config);
  *
  * Returns 0 if operation is successful, negative otherwise.
  */
-int imrsim_clear_zone_config(void);
+int imrsim_clear_zone_config(struct dm_target *ti);
 
 /*
  * IMRSIM_ADD_ZONECONFIG
@@ -265,7 +271,7 @@ int imrsim_clear_zone_config(void);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-//int imrsim_add_zone_config(struct imrsim_zone_status *zone_status);
+//int imrsim_add_zone_config(struct dm_target *ti, struct imrsim_zone_status *zone_status);
 
 /*
  * IMRSIM_MODIFY_ZONECONFIG
@@ -278,7 +284,7 @@ int imrsim_clear_zone_config(void);
  * Returns 0 if operation is successful, negative otherwise.
  *
  */
-//int imrsim_modify_zone_config(struct imrsim_zone_status *zone_status);
+//int imrsim_modify_zone_config(struct dm_target *ti, struct imrsim_zone_status *zone_status);
 
 
 #endif
\ No newline at end of file
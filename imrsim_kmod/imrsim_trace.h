@@ -0,0 +1,142 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM imrsim
+
+#if !defined(_IMRSIM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IMRSIM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the I/O path, e.g.
+ *   echo 1 > /sys/kernel/debug/tracing/events/imrsim/enable
+ * Blocks are 4KB and counted from the start of their zone.
+ */
+
+/* The decision taken by imrsim_map: DM_MAPIO_*. */
+TRACE_EVENT(imrsim_map,
+    TP_PROTO(sector_t sector, unsigned int nr_sectors, int write,
+             __u32 zone_idx, int result),
+    TP_ARGS(sector, nr_sectors, write, zone_idx, result),
+    TP_STRUCT__entry(
+        __field(sector_t,     sector)
+        __field(unsigned int, nr_sectors)
+        __field(int,          write)
+        __field(__u32,        zone_idx)
+        __field(int,          result)
+    ),
+    TP_fast_assign(
+        __entry->sector     = sector;
+        __entry->nr_sectors = nr_sectors;
+        __entry->write      = write;
+        __entry->zone_idx   = zone_idx;
+        __entry->result     = result;
+    ),
+    TP_printk("%s zone=%u sector=%llu nr_sectors=%u result=%d",
+              __entry->write ? "W" : "R", __entry->zone_idx,
+              (unsigned long long)__entry->sector, __entry->nr_sectors,
+              __entry->result)
+);
+
+/* A new block is allocated; phase 1 is the bottom tracks, 2 and 3 the top tracks. */
+TRACE_EVENT(imrsim_alloc,
+    TP_PROTO(__u32 zone_idx, __u32 lba_block, __u32 pba_block,
+             __u32 phase, __u32 map_size),
+    TP_ARGS(zone_idx, lba_block, pba_block, phase, map_size),
+    TP_STRUCT__entry(
+        __field(__u32, zone_idx)
+        __field(__u32, lba_block)
+        __field(__u32, pba_block)
+        __field(__u32, phase)
+        __field(__u32, map_size)
+    ),
+    TP_fast_assign(
+        __entry->zone_idx  = zone_idx;
+        __entry->lba_block = lba_block;
+        __entry->pba_block = pba_block;
+        __entry->phase     = phase;
+        __entry->map_size  = map_size;
+    ),
+    TP_printk("zone=%u lba_block=%u pba_block=%u phase=%u map_size=%u",
+              __entry->zone_idx, __entry->lba_block, __entry->pba_block,
+              __entry->phase, __entry->map_size)
+);
+
+/* An already mapped block is translated for an update or a read. */
+TRACE_EVENT(imrsim_lba_to_pba,
+    TP_PROTO(__u32 zone_idx, __u32 lba_block, __u32 pba_block, int write),
+    TP_ARGS(zone_idx, lba_block, pba_block, write),
+    TP_STRUCT__entry(
+        __field(__u32, zone_idx)
+        __field(__u32, lba_block)
+        __field(__u32, pba_block)
+        __field(int,   write)
+    ),
+    TP_fast_assign(
+        __entry->zone_idx  = zone_idx;
+        __entry->lba_block = lba_block;
+        __entry->pba_block = pba_block;
+        __entry->write     = write;
+    ),
+    TP_printk("%s zone=%u lba_block=%u pba_block=%u",
+              __entry->write ? "W" : "R", __entry->zone_idx,
+              __entry->lba_block, __entry->pba_block)
+);
+
+/* A bottom-track write overlaps a used block of a neighbor top track. */
+TRACE_EVENT(imrsim_wa,
+    TP_PROTO(__u32 zone_idx, __u32 trackno, __u32 top_block, __u32 pba_block),
+    TP_ARGS(zone_idx, trackno, top_block, pba_block),
+    TP_STRUCT__entry(
+        __field(__u32, zone_idx)
+        __field(__u32, trackno)
+        __field(__u32, top_block)
+        __field(__u32, pba_block)
+    ),
+    TP_fast_assign(
+        __entry->zone_idx  = zone_idx;
+        __entry->trackno   = trackno;
+        __entry->top_block = top_block;
+        __entry->pba_block = pba_block;
+    ),
+    TP_printk("zone=%u trackno=%u top_block=%u pba_block=%u",
+              __entry->zone_idx, __entry->trackno, __entry->top_block,
+              __entry->pba_block)
+);
+
+TRACE_EVENT(imrsim_rmw_start,
+    TP_PROTO(sector_t sector, unsigned int nr_blocks),
+    TP_ARGS(sector, nr_blocks),
+    TP_STRUCT__entry(
+        __field(sector_t,     sector)
+        __field(unsigned int, nr_blocks)
+    ),
+    TP_fast_assign(
+        __entry->sector    = sector;
+        __entry->nr_blocks = nr_blocks;
+    ),
+    TP_printk("sector=%llu backup_blocks=%u",
+              (unsigned long long)__entry->sector, __entry->nr_blocks)
+);
+
+TRACE_EVENT(imrsim_rmw_end,
+    TP_PROTO(sector_t sector, int error),
+    TP_ARGS(sector, error),
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(int,      error)
+    ),
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->error  = error;
+    ),
+    TP_printk("sector=%llu error=%d",
+              (unsigned long long)__entry->sector, __entry->error)
+);
+
+#endif /* _IMRSIM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE imrsim_trace
+#include <trace/define_trace.h>
@@ -26,8 +26,12 @@ enum imrsim_zone_type{
     Z_TYPE_PREFERRED    = 0x04
 };
 
+// Words of the bitmap of a top track, one bit per block
+#define TOP_TRACK_WORDS ((TOP_TRACK_SIZE+63)/64)
+
+// The occupancy of the top tracks is kept by the kernel apart from the zone status
 struct imrsim_zone_track{
-    __u8     isUsedBlock[TOP_TRACK_SIZE];
+    __u64    isUsedBlock[TOP_TRACK_WORDS];    // bit n is set when block n holds data
 };
 
 struct imrsim_zone_status    //记录每个zone的基本信息
@@ -37,11 +41,8 @@ struct imrsim_zone_status    //记录每个zone的基本信息
     __u16                        z_conds;                //zoe的状态（空、满、关闭、只读等）
     __u8                         z_type;                 //zone的类型（这里都实现为传统可随机读写的类型）
     __u8                         z_flag;                 //控制此案的读写许可
-	// save the records of all the top tracks in a zone, whether there is data
-    struct imrsim_zone_track     z_tracks[TOP_TRACK_NUM_TOTAL];    //记录每个zone中所有磁道组中顶部磁道的信息，
-    // mapping table                                               //即顶部磁道的各个块是否存有有效数据
+    // size of the mapping table, kept by the kernel
     __u32                        z_map_size;
-    int                          z_pba_map[TOTAL_ITEMS];
 };
 
 struct imrsim_state_header  //记录基础的头部信息
@@ -49,7 +50,8 @@ struct imrsim_state_header  //记录基础的头部信息
     __u32  magic;     //设备标识
     __u32  length;    //imrsim_state结构体的大小
     __u32  version;   //设备版本号
-    __u32  crc32;     //校验和
+    __u32  crc32;     //校验和, of the table of the page crcs which follows the state
+    __u32  seq;       // checkpoint number, the newest copy wins and the journal pages written after it carry it
 };
 
 struct imrsim_idle_stats
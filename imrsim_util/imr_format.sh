@@ -32,12 +32,20 @@ if [[ x"${imr_device}" == x"" ]]; then
 fi
 
 # Computer number of 256 MB zones leaving room for persistence data after last zone.
+# Each zone takes up to 288 KB of it: its part of the two copies of the state and the
+# 272 KB slot of its mapping table. 4 MB more hold the headers and the 1 MB journal.
 device_size_bytes=`blockdev --getsize64 ${imr_device}`
-zones=$(bc <<< "($device_size_bytes-1)/(256*1024*1024)")
-ublk=$(bc <<< "(256*1024*1024*(($device_size_bytes-1)/(256*1024*1024)))/512")
+zones=$(bc <<< "($device_size_bytes-4*1024*1024)/(256*1024*1024+288*1024)")
+ublk=$(bc <<< "$zones*256*1024*1024/512")
+pstore_mb=$(bc <<< "($zones*288+4*1024+1023)/1024")
 
-# Initialize 2 MB at the end of the device for IMRSim persistence data.
-dd if=/dev/zero of=${imr_device} bs=4096 seek=$((ublk+1)) count=512 2> /dev/null 1> /dev/null
+if [[ $zones -lt 1 ]]; then
+   echo "The device is too small for a zone and its persistence data." 1>&2
+   exit 1
+fi
+
+# Initialize the IMRSim persistence data after the last zone.
+dd if=/dev/zero of=${imr_device} bs=1M seek=$((zones*256)) count=${pstore_mb} oflag=direct 2> /dev/null 1> /dev/null
 
 if [[ $show_zones -eq 1 ]]; then
    echo "$zones"
@@ -0,0 +1,68 @@
+usage ()
+{
+   echo "Usage: $0 [-z zone] [-t seconds] [-j jobs] -d imrsim_device"
+   echo "   -z    Zone to test, 0 by default"
+   echo "   -t    Run time in seconds, 60 by default"
+   echo "   -j    Bottom-track writers, 4 by default"
+}
+
+zone=0
+runtime=60
+jobs=4
+imr_device=""
+
+while getopts ":z:t:j:d:" opt; do
+   case $opt in
+      d)
+         imr_device=${OPTARG}
+         ;;
+      z)
+         zone=${OPTARG}
+         ;;
+      t)
+         runtime=${OPTARG}
+         ;;
+      j)
+         jobs=${OPTARG}
+         ;;
+      \?)
+         echo "Invalid option: $OPTARG" 1>&2
+         ;;
+   esac
+done
+
+if [[ $EUID -ne 0 ]]; then
+   echo "You must be a root user (e.g. sudo $0)." 1>&2
+   exit 1
+fi
+
+if [[ x"${imr_device}" == x"" ]]; then
+   usage
+   exit 1
+fi
+
+if ! which fio > /dev/null 2>&1; then
+   echo "fio is needed to run the stress test." 1>&2
+   exit 1
+fi
+
+# A 256 MB zone holds 65536 4 KB blocks, the first 36352 written land on its
+# bottom tracks and the other 29184 on its top tracks.
+zone_blocks=65536
+bottom_blocks=36352
+top_blocks=$((zone_blocks-bottom_blocks))
+zone_start=$((zone*zone_blocks))
+
+# Fill the zone in order so the rewrites of its bottom tracks need a RMW.
+dd if=/dev/zero of=${imr_device} bs=4096 seek=${zone_start} count=${zone_blocks} oflag=direct 2> /dev/null 1> /dev/null
+
+# The top-track writer verifies its blocks while the bottom-track writers
+# make the RMWs back up and write back the same blocks. A write lost to a
+# stale backup fails the verification.
+fio --filename=${imr_device} --ioengine=libaio --direct=1 --bs=4k \
+    --time_based --runtime=${runtime} --group_reporting \
+    --name=top --rw=randwrite --iodepth=16 \
+    --offset=$(((zone_start+bottom_blocks)*4096)) --size=$((top_blocks*4096)) \
+    --verify=crc32c --verify_backlog=1024 --verify_fatal=1 \
+    --name=bottom --rw=randwrite --iodepth=32 --numjobs=${jobs} \
+    --offset=$((zone_start*4096)) --size=$((bottom_blocks*4096))